@@ -273,17 +273,39 @@ bool Classic::WriteDataBlock(byte u8_Block, byte* u8_Data)
 **************************************************************************/
 bool Classic::DataExchange(byte u8_Command, byte u8_Block, byte* u8_Data, byte u8_DataLen)
 {
+    if (!StartDataExchange(u8_Command, u8_Block, u8_Data, u8_DataLen))
+        return false;
+
+    WaitCommand();
+    return FinishDataExchange();
+}
+
+/**************************************************************************
+    The non-blocking version of DataExchange() with the same parameters.
+    Call PollCommand() until it does not return JOB_Busy anymore, then call FinishDataExchange().
+    ATTENTION: u8_Data must stay valid until FinishDataExchange() has been called.
+**************************************************************************/
+bool Classic::StartDataExchange(byte u8_Command, byte u8_Block, byte* u8_Data, byte u8_DataLen)
+{
+    mu8_ExchangeCommand = u8_Command;
+    mpu8_ExchangeData   = u8_Data;
+
     mu8_PacketBuffer[0] = PN532_COMMAND_INDATAEXCHANGE;
-    mu8_PacketBuffer[1] = 1; // Card number (Logical target number)
+    mu8_PacketBuffer[1] = mu8_Target; // Card number (Logical target number, see SetTarget())
     mu8_PacketBuffer[2] = u8_Command;
     mu8_PacketBuffer[3] = u8_Block;
 
     memcpy(mu8_PacketBuffer + 4, u8_Data, u8_DataLen);
     
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 4 + u8_DataLen))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 26);
+    return StartCommand(mu8_PacketBuffer, 4 + u8_DataLen);
+}
+
+bool Classic::FinishDataExchange()
+{
+    byte  u8_Command = mu8_ExchangeCommand;
+    byte* u8_Data    = mpu8_ExchangeData;
+
+    byte len = FinishCommand();
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1)
     {
         Utils::Print("DataExchange failed\r\n");
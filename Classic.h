@@ -22,6 +22,8 @@
 class Classic : public PN532
 {
   public:
+    Classic(PN532Transport* pi_Transport, byte u8_Reset) : PN532(pi_Transport, u8_Reset) {}
+
     bool DumpCardMemory(char s8_KeyType, const byte* u8_Keys, bool b_ShowAccessBits);
     bool AuthenticateDataBlock(byte u8_Block, char s8_KeyType, const byte* u8_KeyData, const byte* u8_Uid, byte u8_UidLen);
     bool ReadDataBlock (byte u8_Block, byte* u8_Data);
@@ -29,9 +31,17 @@ class Classic : public PN532
     bool GetValue(byte* u8_Data, uint32_t* pu32_Value, byte* pu8_Address);
     void SetValue(byte* u8_Data, uint32_t   u32_Value, byte   u8_Address);
    
+ protected:
+    // Resumable (non-blocking) version of DataExchange()
+    bool StartDataExchange(byte u8_Command, byte u8_Block, byte* u8_Data, byte u8_DataLen);
+    bool FinishDataExchange();
+
  private:
     bool DataExchange(byte u8_Command, byte u8_Block, byte* u8_Data, byte u8_DataLen);
     void ShowAccessBits(byte u8_Block, byte u8_Byte7, byte u8_Byte8);    
+
+    byte  mu8_ExchangeCommand; // Remembers the parameters between StartDataExchange() and FinishDataExchange()
+    byte* mpu8_ExchangeData;
 };
 
 #endif
@@ -44,6 +44,7 @@ public:
     {
         ms32_KeySize   = 0;
         ms32_BlockSize = 0;
+        ms32_CmacCount = 0;
         mu8_Version    = 0;
         me_KeyType     = DF_KEY_INVALID;
     }
@@ -114,30 +115,54 @@ public:
         return true;
     }
 
-    // Calculate the CMAC (Cipher-based Message Authentication Code) from the given data.
+    // Calculate the CMAC (Cipher-based Message Authentication Code) from data that arrives in chunks.
     // The CMAC is the initialization vector (IV) after a CBC encryption of the given data.
-    // ATTENTION: The content of i_Buffer will be modified!!
-    bool CalculateCmac(TxBuffer& i_Buffer, byte u8_Cmac[16])
+    // CmacBegin() starts a new message, CmacUpdate() absorbs the next chunk directly from the caller's buffer,
+    // CmacFinal() pads the message and returns the CMAC. No copy of the message is required.
+    inline void CmacBegin()
     {
-        // If the data length is not a multiple of the block size -> pad the buffer with 80,00,00,00,....
-        if ((i_Buffer.GetCount() == 0) || (i_Buffer.GetCount() % ms32_BlockSize))
+        ms32_CmacCount = 0;
+    }
+
+    // Only the last block of the message is kept in mu8_CmacBlock because it must be XOR-ed with a subkey in CmacFinal().
+    // A complete block is encrypted as soon as the next byte arrives, because then it cannot be the last one anymore.
+    bool CmacUpdate(const byte* u8_Data, int s32_Length)
+    {
+        while (s32_Length > 0)
         {
-            if (!i_Buffer.AppendUint8(0x80))
-                return false; // Buffer is full
-                
-            while (i_Buffer.GetCount() % ms32_BlockSize)
+            if (ms32_CmacCount == ms32_BlockSize)
             {
-                if (!i_Buffer.AppendUint8(0x00))
-                    return false; // Buffer is full
+                if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_CmacBlock, mu8_CmacBlock, ms32_BlockSize))
+                    return false;
+
+                ms32_CmacCount = 0;
             }
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac2, ms32_BlockSize);
+
+            int s32_Copy = min(s32_Length, ms32_BlockSize - ms32_CmacCount);
+            memcpy(mu8_CmacBlock + ms32_CmacCount, u8_Data, s32_Copy);
+            ms32_CmacCount += s32_Copy;
+            u8_Data        += s32_Copy;
+            s32_Length     -= s32_Copy;
+        }
+        return true;
+    }
+
+    bool CmacFinal(byte u8_Cmac[16])
+    {
+        // If the data length is not a multiple of the block size -> pad the last block with 80,00,00,00,....
+        if (ms32_CmacCount < ms32_BlockSize)
+        {
+            mu8_CmacBlock[ms32_CmacCount] = 0x80;
+            memset(mu8_CmacBlock + ms32_CmacCount + 1, 0, ms32_BlockSize - ms32_CmacCount - 1);
+            Utils::XorDataBlock(mu8_CmacBlock, mu8_Cmac2, ms32_BlockSize);
         } 
         else // no padding required
         {
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac1, ms32_BlockSize);
+            Utils::XorDataBlock(mu8_CmacBlock, mu8_Cmac1, ms32_BlockSize);
         }
 
-        if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, i_Buffer, i_Buffer, i_Buffer.GetCount()))
+        ms32_CmacCount = 0;
+        if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, mu8_CmacBlock, mu8_CmacBlock, ms32_BlockSize))
             return false;
             
         memcpy(u8_Cmac, mu8_IV, ms32_BlockSize);
@@ -246,6 +271,8 @@ protected:
 
     byte mu8_Cmac1[16]; // CMAC subkey 1
     byte mu8_Cmac2[16]; // CMAC subkey 2
+    byte mu8_CmacBlock[16]; // the last block of the message (see CmacUpdate())
+    int  ms32_CmacCount;    // the count of bytes in mu8_CmacBlock
 };
 
 #endif // DESFIRE_KEY_H
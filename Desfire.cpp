@@ -34,13 +34,18 @@
 #include "Desfire.h"
 #include "Secrets.h"
 
-Desfire::Desfire() 
-    : mi_CmacBuffer(mu8_CmacBuffer_Data, sizeof(mu8_CmacBuffer_Data))
+Desfire::Desfire(PN532Transport* pi_Transport, byte u8_Reset) 
+    : PN532(pi_Transport, u8_Reset)
 {
-    mpi_SessionKey       = NULL;
-    mu8_LastAuthKeyNo    = NOT_AUTHENTICATED;
     mu8_LastPN532Error   = 0;    
-    mu32_LastApplication = 0x000000; // No application selected
+    mpk_Session          = &mk_Sessions[0]; // Target 1
+    ResetSessions();
+
+    mu32_Timeouts[DF_TMO_Read]   = DF_TIMEOUT_READ;
+    mu32_Timeouts[DF_TMO_Auth]   = DF_TIMEOUT_AUTH;
+    mu32_Timeouts[DF_TMO_Write]  = DF_TIMEOUT_WRITE;
+    mu32_Timeouts[DF_TMO_Format] = DF_TIMEOUT_FORMAT;
+    me_LastTimeout = DF_TMO_Read;
 
     // The PICC master key on an empty card is a simple DES key filled with 8 zeros
     const byte ZERO_KEY[24] = {0};
@@ -49,15 +54,138 @@ Desfire::Desfire()
      AES_DEFAULT_KEY.SetKeyData(ZERO_KEY, 16, 0);
 }
 
-// Whenever the RF field is switched off, these variables must be reset
+// Whenever the RF field is switched off, the sessions of all cards must be reset
 bool Desfire::SwitchOffRfField()
 {
-    mu8_LastAuthKeyNo    = NOT_AUTHENTICATED;
-    mu32_LastApplication = 0x000000; // No application selected
-
+    ResetSessions();
     return PN532::SwitchOffRfField();
 }
 
+// In power down the RF field is off as well
+bool Desfire::EnterPowerDown(byte u8_WakeSources)
+{
+    ResetSessions();
+    return PN532::EnterPowerDown(u8_WakeSources);
+}
+
+// One trial of TuneRf(): activates the card and reads the version (3 frames)
+// returns 0 on success or the error of the PN532 (0x01 = timeout)
+byte Desfire::RfTrial()
+{
+    byte u8_Error = PN532::RfTrial();
+    if (u8_Error != 0)
+        return u8_Error;
+
+    DESFireCardVersion k_Version;
+    if (GetCardVersion(&k_Version))
+        return 0;
+
+    // The card is not a Desfire card or it has returned an error
+    return mu8_LastPN532Error ? mu8_LastPN532Error : 0xFF;
+}
+
+void Desfire::ResetSessions()
+{
+    for (byte T=0; T<PN532_MAX_TARGETS; T++)
+    {
+        mk_Sessions[T].pi_SessionKey       = NULL;
+        mk_Sessions[T].u8_LastAuthKeyNo    = NOT_AUTHENTICATED;
+        mk_Sessions[T].u32_LastApplication = 0x000000; // No application selected
+        memset(mk_Sessions[T].u8_FileModes, 0xFF, DF_MAX_FILES);
+    }
+}
+
+// Sets the deadline of the host in milliseconds for the response of the card to all commands of the given class.
+// If the card does not answer in time, DataExchange() fails and the command can be repeated.
+void Desfire::SetExchangeTimeout(DESFireTimeout e_Class, uint32_t u32_Timeout)
+{
+    if (e_Class < DF_TMO_Count)
+        mu32_Timeouts[e_Class] = u32_Timeout;
+}
+
+// Returns the timeout class of a command
+DESFireTimeout Desfire::GetTimeoutClass(byte u8_Command)
+{
+    switch (u8_Command)
+    {
+        case DF_INS_ADDITIONAL_FRAME: // the next frame of the previous command
+            return me_LastTimeout;
+
+        case DF_INS_AUTHENTICATE_LEGACY:
+        case DFEV1_INS_AUTHENTICATE_ISO:
+        case DFEV1_INS_AUTHENTICATE_AES:
+            return DF_TMO_Auth;
+
+        case DF_INS_FORMAT_PICC:
+            return DF_TMO_Format;
+
+        case DF_INS_CHANGE_KEY_SETTINGS:
+        case DF_INS_CHANGE_KEY:
+        case DF_INS_CREATE_APPLICATION:
+        case DF_INS_DELETE_APPLICATION:
+        case DF_INS_CHANGE_FILE_SETTINGS:
+        case DF_INS_CREATE_STD_DATA_FILE:
+        case DF_INS_CREATE_BACKUP_DATA_FILE:
+        case DF_INS_CREATE_VALUE_FILE:
+        case DF_INS_CREATE_LINEAR_RECORD_FILE:
+        case DF_INS_CREATE_CYCLIC_RECORD_FILE:
+        case DF_INS_DELETE_FILE:
+        case DF_INS_WRITE_DATA:
+        case DF_INS_CREDIT:
+        case DF_INS_DEBIT:
+        case DF_INS_LIMITED_CREDIT:
+        case DF_INS_WRITE_RECORD:
+        case DF_INS_CLEAR_RECORD_FILE:
+        case DF_COMMIT_TRANSACTION:
+        case DFEV1_INS_SET_CONFIGURATION:
+            return DF_TMO_Write;
+
+        default:
+            return DF_TMO_Read;
+    }
+}
+
+// Returns the deadline in milliseconds for a command of the given class.
+// Commands that do not write to the EEPROM are answered within the frame waiting time (FWT) from the ATS.
+// The card may request more time (WTX) once, so the deadline is 2 * FWT + DF_FWT_MARGIN, but never more than the configured timeout.
+// Writing to the EEPROM takes an unpredictable count of WTX requests, so these commands always use the configured timeout.
+uint32_t Desfire::GetExchangeTimeout(DESFireTimeout e_Class)
+{
+    uint32_t u32_Timeout = mu32_Timeouts[e_Class];
+    if (u32_Timeout == 0 || (e_Class != DF_TMO_Read && e_Class != DF_TMO_Auth))
+        return u32_Timeout;
+
+    const kPN532Ats* pk_Ats = GetCardAts();
+    if (pk_Ats->u16_FSC == 0) // no ATS
+        return u32_Timeout;
+
+    uint32_t u32_FWT = (2 * pk_Ats->u32_FWT + 999) / 1000 + DF_FWT_MARGIN;
+    return min(u32_Timeout, u32_FWT);
+}
+
+// Returns the maximum total length of a packet that the current card accepts in one frame (FSC from the ATS)
+// but not more than fits into the PN532 packet buffer.
+int Desfire::GetFrameSize()
+{
+    int s32_Size = MAX_FRAME_SIZE;
+    const kPN532Ats* pk_Ats = GetCardAts();
+    if (pk_Ats->u16_FSC > DF_BLOCK_OVERHEAD)
+        s32_Size = pk_Ats->u16_FSC - DF_BLOCK_OVERHEAD;
+
+    return min(s32_Size, (int)MAX_EXCHANGE_SIZE);
+}
+
+// Each card that has been returned by ReadPassiveTargets() has its own session (authentication, application, session key).
+// After switching to another card and back the session of the first card continues where it was.
+bool Desfire::SetTarget(byte u8_Tg)
+{
+    if (!PN532::SetTarget(u8_Tg))
+        return false;
+
+    mpk_Session = &mk_Sessions[u8_Tg - 1];
+    return true;
+}
+
 /**************************************************************************
     Does an ISO authentication with a 2K3DES key or an AES authentication with an AES key.
     pi_Key must be an instance of DES or AES.
@@ -206,20 +334,20 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
         }
     }
        
-    if (pi_Key->GetKeyType() == DF_KEY_AES) mpi_SessionKey = &mi_AesSessionKey;
-    else                                    mpi_SessionKey = &mi_DesSessionKey;
+    if (pi_Key->GetKeyType() == DF_KEY_AES) mpk_Session->pi_SessionKey = &mpk_Session->i_AesSessionKey;
+    else                                    mpk_Session->pi_SessionKey = &mpk_Session->i_DesSessionKey;
     
-    if (!mpi_SessionKey->SetKeyData(i_SessKey, i_SessKey.GetCount(), 0) ||
-        !mpi_SessionKey->GenerateCmacSubkeys())
+    if (!mpk_Session->pi_SessionKey->SetKeyData(i_SessKey, i_SessKey.GetCount(), 0) ||
+        !mpk_Session->pi_SessionKey->GenerateCmacSubkeys())
         return false;
 
     if (mu8_DebugLevel > 0)
     {
         Utils::Print("* SessKey:   ");
-        mpi_SessionKey->PrintKey(LF);
+        mpk_Session->pi_SessionKey->PrintKey(LF);
     }
 
-    mu8_LastAuthKeyNo = u8_KeyNo;   
+    mpk_Session->u8_LastAuthKeyNo = u8_KeyNo;   
     return true;
 }
 
@@ -247,7 +375,7 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
         Utils::Print(s8_Buf);
     }
 
-    if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+    if (mpk_Session->u8_LastAuthKeyNo == NOT_AUTHENTICATED)
     {
         Utils::Print("Not authenticated\r\n");
         return false;
@@ -256,7 +384,7 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
     if (mu8_DebugLevel > 0)
     {
         Utils::Print("* SessKey IV:  ");
-        mpi_SessionKey->PrintIV(LF);
+        mpk_Session->pi_SessionKey->PrintIV(LF);
         Utils::Print("* New Key:     ");
         pi_NewKey->PrintKey(LF);
     }    
@@ -267,11 +395,11 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
     TX_BUFFER(i_Cryptogram, 40);
     i_Cryptogram.AppendBuf(pi_NewKey->Data(), pi_NewKey->GetKeySize(16));
 
-    bool b_SameKey = (u8_KeyNo == mu8_LastAuthKeyNo);  // false -> change another key than the one that was used for authentication
+    bool b_SameKey = (u8_KeyNo == mpk_Session->u8_LastAuthKeyNo);  // false -> change another key than the one that was used for authentication
 
     // The type of key can only be changed for the PICC master key.
     // Applications must define their key type in CreateApplication().
-    if (mu32_LastApplication == 0x000000)
+    if (mpk_Session->u32_LastApplication == 0x000000)
         u8_KeyNo |= pi_NewKey->GetKeyType();
 
     // The following if() applies only to application keys.
@@ -325,10 +453,10 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
     if (i_Cryptogram.GetCount() > 32) s32_CryptoLen = 40;
 
     // For a blocksize of 16 byte (AES) the data length 24 is not valid -> increase to 32
-    s32_CryptoLen = mpi_SessionKey->CalcPaddedBlockSize(s32_CryptoLen);
+    s32_CryptoLen = mpk_Session->pi_SessionKey->CalcPaddedBlockSize(s32_CryptoLen);
 
     byte u8_Cryptogram_enc[40] = {0}; // encrypted cryptogram
-    if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Cryptogram_enc, i_Cryptogram, s32_CryptoLen))
+    if (!mpk_Session->pi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Cryptogram_enc, i_Cryptogram, s32_CryptoLen))
         return false;
 
     if (mu8_DebugLevel > 0)
@@ -344,7 +472,7 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
     i_Params.AppendBuf  (u8_Cryptogram_enc, s32_CryptoLen);
 
     // If the same key has been changed the session key is no longer valid. (Authentication required)
-    if (b_SameKey) mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+    if (b_SameKey) mpk_Session->u8_LastAuthKeyNo = NOT_AUTHENTICATED;
 
     return (0 == DataExchange(DF_INS_CHANGE_KEY, &i_Params, NULL, 0, NULL, MAC_Rmac));
 }
@@ -393,12 +521,12 @@ bool Desfire::GetCardVersion(DESFireCardVersion* pk_Version)
         return false;
 
     pu8_Ptr += 7;
-    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 7, &e_Status, MAC_Rmac);
+    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 7, &e_Status, MAC_RmacRchain);
     if (s32_Read != 7 || e_Status != ST_MoreFrames)
         return false;
 
     pu8_Ptr += 7;
-    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 14, &e_Status, MAC_Rmac);
+    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 14, &e_Status, MAC_RmacRchain);
     if (s32_Read != 14 || e_Status != ST_Success)
         return false;
 
@@ -521,22 +649,23 @@ bool Desfire::GetRealCardID(byte u8_UID[7])
 {
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** GetRealCardID()\r\n");
 
-    if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+    if (mpk_Session->u8_LastAuthKeyNo == NOT_AUTHENTICATED)
     {
         Utils::Print("Not authenticated\r\n");
         return false;
     }
 
-    RX_BUFFER(i_Data, 16);
-    if (16 != DataExchange(DFEV1_INS_GET_CARD_UID, NULL, i_Data, 16, NULL, MAC_TmacRcrypt))
+    if (16 != DataExchange(DFEV1_INS_GET_CARD_UID, NULL, NULL, 16, NULL, MAC_TmacRcrypt))
         return false;
 
-    // The card returns UID[7] + CRC32[4] encrypted with the session key
-    // Copy the 7 bytes of the UID to the output buffer
-    i_Data.ReadBuf(u8_UID, 7);
+    // The card returns UID[7] + CRC32[4] encrypted with the session key.
+    // It has been decrypted in the packet buffer: copy the 7 bytes of the UID to the output buffer
+    const byte* u8_Data = GetResponseData();
+    memcpy(u8_UID, u8_Data, 7);
 
     // Get the CRC sent by the card
-    uint32_t u32_Crc1 = i_Data.ReadUint32();
+    uint32_t u32_Crc1;
+    memcpy(&u32_Crc1, u8_Data + 7, 4);
 
     // The CRC must be calculated over the UID + the status byte appended
     byte u8_Status = ST_Success;
@@ -605,7 +734,7 @@ bool Desfire::GetApplicationIDs(uint32_t u32_IDlist[28], byte* pu8_AppCount)
     byte* pu8_Ptr = i_RxBuf;
 
     DESFireStatus e_Status;
-    int s32_Read1 = DataExchange(DF_INS_GET_APPLICATION_IDS, NULL, pu8_Ptr, MAX_FRAME_SIZE, &e_Status, MAC_TmacRmac);
+    int s32_Read1 = DataExchange(DF_INS_GET_APPLICATION_IDS, NULL, pu8_Ptr, min(GetFrameSize(), 28 * 3), &e_Status, MAC_TmacRmac);
     if (s32_Read1 < 0)
         return false;
 
@@ -614,7 +743,7 @@ bool Desfire::GetApplicationIDs(uint32_t u32_IDlist[28], byte* pu8_AppCount)
     if (e_Status == ST_MoreFrames)
     {
         pu8_Ptr += s32_Read1;
-        s32_Read2 = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 28 * 3 - s32_Read1, NULL, MAC_Rmac);
+        s32_Read2 = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 28 * 3 - s32_Read1, NULL, MAC_RmacRchain);
         if (s32_Read2 < 0)
             return false;
     }
@@ -739,8 +868,9 @@ bool Desfire::SelectApplication(uint32_t u32_AppID)
     if (0 != DataExchange(DF_INS_SELECT_APPLICATION, &i_Params, NULL, 0, NULL, MAC_None))
         return false;
 
-    mu8_LastAuthKeyNo    = NOT_AUTHENTICATED; // set to invalid value (the selected app requires authentication)
-    mu32_LastApplication = u32_AppID;
+    mpk_Session->u8_LastAuthKeyNo    = NOT_AUTHENTICATED; // set to invalid value (the selected app requires authentication)
+    mpk_Session->u32_LastApplication = u32_AppID;
+    ForgetFileModes();
     return true;
 }
 
@@ -803,6 +933,18 @@ bool Desfire::GetFileSettings(byte u8_FileID, DESFireFileSettings* pk_Settings)
     pk_Settings->e_Encrypt  = (DESFireFileEncryption)i_RetData.ReadUint8();
     pk_Settings->k_Permis.Unpack                    (i_RetData.ReadUint16());
 
+    // Remember the communication mode for ReadFileData() and WriteFileData().
+    // If the access right is AR_FREE the card always transfers the data in plain.
+    if (u8_FileID < DF_MAX_FILES)
+    {
+        DESFireFilePermissions* pk_Permis = &pk_Settings->k_Permis;
+        byte u8_Read  = pk_Settings->e_Encrypt;
+        byte u8_Write = pk_Settings->e_Encrypt;
+        if (pk_Permis->e_ReadAccess  == AR_FREE || pk_Permis->e_ReadAndWriteAccess == AR_FREE) u8_Read  = CM_PLAIN;
+        if (pk_Permis->e_WriteAccess == AR_FREE || pk_Permis->e_ReadAndWriteAccess == AR_FREE) u8_Write = CM_PLAIN;
+        mpk_Session->u8_FileModes[u8_FileID] = (u8_Write << 4) | u8_Read;
+    }
+
     char s8_Buf[150];
     if (mu8_DebugLevel > 0)
     {
@@ -861,8 +1003,9 @@ bool Desfire::GetFileSettings(byte u8_FileID, DESFireFileSettings* pk_Settings)
 
 /**************************************************************************
     Creates a standard data file (a simple binary file) of a fixed size in the selected application.
+    e_Encrypt defines how ReadFileData() and WriteFileData() transfer the data if the access right is not AR_FREE.
 **************************************************************************/
-bool Desfire::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize)
+bool Desfire::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt)
 {
     if (mu8_DebugLevel > 0)
     {
@@ -871,16 +1014,68 @@ bool Desfire::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permi
         Utils::Print(s8_Buf);
     }
 
+    return CreateDataFile(DF_INS_CREATE_STD_DATA_FILE, u8_FileID, pk_Permis, s32_FileSize, e_Encrypt);
+}
+
+/**************************************************************************
+    Creates a backup data file of a fixed size in the selected application.
+    It works like a standard data file, but the changes written with WriteFileData() 
+    become valid only after CommitTransaction() (see DESFireTransaction).
+**************************************************************************/
+bool Desfire::CreateBackupDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** CreateBackupDataFile(ID= %d, Size= %d)\r\n", u8_FileID, s32_FileSize);
+        Utils::Print(s8_Buf);
+    }
+
+    return CreateDataFile(DF_INS_CREATE_BACKUP_DATA_FILE, u8_FileID, pk_Permis, s32_FileSize, e_Encrypt);
+}
+
+bool Desfire::CreateDataFile(byte u8_Command, byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt)
+{
     uint16_t u16_Permis = pk_Permis->Pack();
   
     TX_BUFFER(i_Params, 7);
     i_Params.AppendUint8 (u8_FileID);
-    i_Params.AppendUint8 (CM_PLAIN);
+    i_Params.AppendUint8 (e_Encrypt);
     i_Params.AppendUint16(u16_Permis);
     i_Params.AppendUint24(s32_FileSize); // only the low 3 bytes are used
 
-    return (0 == DataExchange(DF_INS_CREATE_STD_DATA_FILE, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+    ForgetFileModes(u8_FileID);
+    return (0 == DataExchange(u8_Command, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+}
+
+/**************************************************************************
+    Creates a value file in the selected application.
+    The value is a signed 32 bit integer that can be changed only within the limits with Credit() and Debit().
+    If b_LimitedCredit is true, LimitedCredit() allows to undo the last Debit() without full write access.
+    All changes become valid only after CommitTransaction() (see DESFireTransaction).
+**************************************************************************/
+bool Desfire::CreateValueFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_LowerLimit, int s32_UpperLimit, int s32_Value, bool b_LimitedCredit, DESFireFileEncryption e_Encrypt)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[100];
+        sprintf(s8_Buf, "\r\n*** CreateValueFile(ID= %d, Lower= %d, Upper= %d, Value= %d)\r\n", u8_FileID, s32_LowerLimit, s32_UpperLimit, s32_Value);
+        Utils::Print(s8_Buf);
+    }
+
+    uint16_t u16_Permis = pk_Permis->Pack();
+  
+    TX_BUFFER(i_Params, 17);
+    i_Params.AppendUint8 (u8_FileID);
+    i_Params.AppendUint8 (e_Encrypt);
+    i_Params.AppendUint16(u16_Permis);
+    i_Params.AppendUint32(s32_LowerLimit);
+    i_Params.AppendUint32(s32_UpperLimit);
+    i_Params.AppendUint32(s32_Value);
+    i_Params.AppendUint8 (b_LimitedCredit ? 0x01 : 0x00);
 
+    ForgetFileModes(u8_FileID);
+    return (0 == DataExchange(DF_INS_CREATE_VALUE_FILE, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
 }
 
 /**************************************************************************
@@ -898,6 +1093,7 @@ bool Desfire::DeleteFile(byte u8_FileID)
     TX_BUFFER(i_Params, 1);
     i_Params.AppendUint8(u8_FileID);
 
+    ForgetFileModes(u8_FileID);
     return (0 == DataExchange(DF_INS_DELETE_FILE, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
 }
 
@@ -906,6 +1102,7 @@ bool Desfire::DeleteFile(byte u8_FileID)
     If (s32_Offset + s32_Length > file length) you will get a LimitExceeded error.
     If the file permissins are not set to AR_FREE you must authenticate either
     with the key in e_ReadAccess or the key in e_ReadAndWriteAccess.   
+    The communication mode (CM_PLAIN, CM_MAC, CM_ENCRYPT) is taken from the file settings (see GetFileMode()).
 **************************************************************************/
 bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer)
 {
@@ -916,27 +1113,46 @@ bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte*
         Utils::Print(s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames received.
-    // When reading a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
+    if (s32_Length == 0)
+        return true;
+
+    DESFireFileEncryption e_Mode;
+    if (!GetFileMode(u8_FileID, false, &e_Mode))
+        return false;
+
+    TX_BUFFER(i_Params, 7);
+    i_Params.AppendUint8 (u8_FileID);
+    i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Params.AppendUint24(s32_Length); // only the low 3 bytes are used
+
+    if (e_Mode == CM_ENCRYPT)
+        return ReceiveEncrypted(DF_INS_READ_DATA, &i_Params, u8_DataBuffer, s32_Length);
+
+    // CM_PLAIN and CM_MAC are the same for reading: the card appends a CMAC to the last frame.
+    // One command reads the entire block. The card sends it in several frames and returns ST_MoreFrames until the last one.
+    // The following frames are requested with DF_INS_ADDITIONAL_FRAME. The CMAC is calculated over all frames received 
+    // while they arrive (see DESFireKey::CmacUpdate()) so the length is not limited by any buffer.
+
+    byte u8_Command = DF_INS_READ_DATA;
+    DESFireCmac e_Mac = MAC_TmacRmac;
+    DESFireStatus e_Status = ST_Success;
     while (s32_Length > 0)
     {
-        int s32_Count = min(s32_Length, 48); // the maximum that can be transferred in one frame (must be a multiple of 16 if encryption is used)
-
-        TX_BUFFER(i_Params, 7);
-        i_Params.AppendUint8 (u8_FileID);
-        i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
-        i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
-        
-        DESFireStatus e_Status;
-        int s32_Read = DataExchange(DF_INS_READ_DATA, &i_Params, u8_DataBuffer, s32_Count, &e_Status, MAC_TmacRmac);
-        if (e_Status != ST_Success || s32_Read <= 0)
-            return false; // ST_MoreFrames is not allowed here!
+        int s32_Read = DataExchange(u8_Command, &i_Params, u8_DataBuffer, min(s32_Length, MAX_EXCHANGE_SIZE), &e_Status, e_Mac);
+        if (s32_Read <= 0)
+            return false;
 
         s32_Length    -= s32_Read;
-        s32_Offset    += s32_Read;
         u8_DataBuffer += s32_Read;
+
+        if (e_Status != ST_MoreFrames)
+            return (s32_Length == 0);
+
+        u8_Command = DF_INS_ADDITIONAL_FRAME;
+        e_Mac      = MAC_RmacRchain;
+        i_Params.Clear();
     }
-    return true;
+    return (e_Status == ST_Success); // ST_MoreFrames: the card has more data than requested
 }
 
 /**************************************************************************
@@ -953,214 +1169,824 @@ bool Desfire::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, cons
         Utils::Print(s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames sent.
-    // When writing a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
-    while (s32_Length > 0)
-    {
-        int s32_Count = min(s32_Length, MAX_FRAME_SIZE - 8); // DF_INS_WRITE_DATA + u8_FileID + s32_Offset + s32_Count = 8 bytes
-              
-        TX_BUFFER(i_Params, MAX_FRAME_SIZE); 
-        i_Params.AppendUint8 (u8_FileID);
-        i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
-        i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
-        i_Params.AppendBuf(u8_DataBuffer, s32_Count);
+    if (s32_Length == 0)
+        return true;
 
-        DESFireStatus e_Status;
-        int s32_Read = DataExchange(DF_INS_WRITE_DATA, &i_Params, NULL, 0, &e_Status, MAC_TmacRmac);
-        if (e_Status != ST_Success || s32_Read != 0)
-            return false; // ST_MoreFrames is not allowed here!
+    DESFireFileEncryption e_Mode;
+    if (!GetFileMode(u8_FileID, true, &e_Mode))
+        return false;
 
-        s32_Length    -= s32_Count;
-        s32_Offset    += s32_Count;
-        u8_DataBuffer += s32_Count;
-    }
-    return true;
+    TX_BUFFER(i_Header, 7); 
+    i_Header.AppendUint8 (u8_FileID);
+    i_Header.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Header.AppendUint24(s32_Length); // only the low 3 bytes are used
+
+    return SendFileData(DF_INS_WRITE_DATA, &i_Header, u8_DataBuffer, s32_Length, e_Mode);
 }
 
 /**************************************************************************
-    Reads the value of a Value File
+    Sets the communication mode of a file in the selected application when the caller knows it.
+    Then GetFileMode() does not read the file settings from the card, which saves one command for each
+    SelectApplication() and works also if the application does not allow GetFileSettings() with the current key.
+    Call it after SelectApplication() because selecting an application forgets all modes.
+    ATTENTION: If the access right is AR_FREE the card transfers the data in plain (see GetFileSettings()).
 **************************************************************************/
-bool Desfire::ReadFileValue(byte u8_FileID, uint32_t* pu32_Value)
+bool Desfire::SetFileMode(byte u8_FileID, DESFireFileEncryption e_Read, DESFireFileEncryption e_Write)
 {
-	TX_BUFFER(i_Params, 1);
-	i_Params.AppendUint8(u8_FileID);
-
-	RX_BUFFER(i_RetData, 4);
-	if (4 != DataExchange(DF_INS_GET_VALUE, &i_Params, i_RetData, 4, NULL, MAC_TmacRmac))
-		return false;
+    if (u8_FileID >= DF_MAX_FILES)
+    {
+        Utils::Print("Invalid file ID\r\n");
+        return false;
+    }
 
-	*pu32_Value = i_RetData.ReadUint32();
-	return true;
+    mpk_Session->u8_FileModes[u8_FileID] = (e_Write << 4) | e_Read;
+    return true;
 }
 
-// ########################################################################
-// ####                      LOW LEVEL FUNCTIONS                      #####
-// ########################################################################
+// Invalidates the cached communication mode of one file or of all files (s32_FileID = -1)
+void Desfire::ForgetFileModes(int s32_FileID)
+{
+    if (s32_FileID < 0)
+        memset(mpk_Session->u8_FileModes, 0xFF, DF_MAX_FILES);
+    else if (s32_FileID < DF_MAX_FILES)
+        mpk_Session->u8_FileModes[s32_FileID] = 0xFF;
+}
 
-// If this value is != 0, the PN532 has returned an error code while executing the latest command.
-// Typically a Timeout error (Value = 0x01) means that the card is too far away from the reader.
-// Interestingly a timeout occurres typically when authenticating. 
-// The commands that are executed first (GetKeyVersion and SelectApplication) execute without problems.
-// But it when it comes to Authenticate() the card suddenly does not respond anymore -> Timeout from PN532.
-// Conclusion: It seems that a Desfire card increases its power consumption in the moment when encrypting data,
-// so when it is too far away from the antenna -> the connection dies -> no answer -> timeout.
-byte Desfire::GetLastPN532Error()
+// Returns the communication mode that the card uses to transfer the data of a file.
+// Without authentication the data can only be accessed with AR_FREE and is always transferred in plain.
+// Otherwise the file settings are read from the card only once and cached until another application is selected.
+// ATTENTION: If the application does not allow GetFileSettings() with the current key, the card error cancels the
+// authentication. Then call SetFileMode() or GetFileSettings() before authenticating.
+bool Desfire::GetFileMode(byte u8_FileID, bool b_Write, DESFireFileEncryption* pe_Mode)
 {
-    return mu8_LastPN532Error;
+    *pe_Mode = CM_PLAIN;
+    if (mpk_Session->u8_LastAuthKeyNo == NOT_AUTHENTICATED)
+        return true;
+
+    if (u8_FileID >= DF_MAX_FILES)
+    {
+        Utils::Print("Invalid file ID\r\n");
+        return false;
+    }
+
+    if (mpk_Session->u8_FileModes[u8_FileID] == 0xFF)
+    {
+        DESFireFileSettings k_Settings;
+        if (!GetFileSettings(u8_FileID, &k_Settings))
+            return false;
+    }
+
+    byte u8_Mode = mpk_Session->u8_FileModes[u8_FileID];
+    switch (b_Write ? (u8_Mode >> 4) : (u8_Mode & 0x0F))
+    {
+        case CM_MAC:     *pe_Mode = CM_MAC;     break;
+        case CM_ENCRYPT: *pe_Mode = CM_ENCRYPT; break;
+        default:         *pe_Mode = CM_PLAIN;   break;
+    }
+    return true;
 }
 
 /**************************************************************************
-    Sends data to the card and receives the response.
-    u8_Command    = Desfire command without additional paramaters
-    pi_Command    = Desfire command + possible additional paramaters that will not be encrypted
-    pi_Params     = Desfire command parameters that may be encrypted (MAC_Tcrypt). This paramater may also be null.
-    u8_RecvBuf    = buffer that receives the received data (should be the size of the expected recv data)
-   s32_RecvSize   = buffer size of u8_RecvBuf
-    pe_Status     = if (!= NULL) -> receives the status byte
-    e_Mac         = defines CMAC calculation
-    returns the byte count that has been read into u8_RecvBuf or -1 on error
+    Sends a command that transfers data to a file: u8_Command + pi_Header + data
+    The data is secured depending on the communication mode of the file:
+    CM_PLAIN:   data                                 (the CMAC is calculated, but not transmitted)
+    CM_MAC:     data + CMAC (8 bytes)
+    CM_ENCRYPT: encrypted (data + CRC32 + zero padding)
+    The CMAC and the CRC32 are calculated over the command, the header and the data.
+    Everything that does not fit into the first frame is sent with DF_INS_ADDITIONAL_FRAME.
+    The card returns ST_MoreFrames for each frame except the last one which returns the RX CMAC.
+    The data is read directly from u8_Data and encrypted frame by frame in the packet buffer.
 **************************************************************************/
-int Desfire::DataExchange(byte u8_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac)
-{
-    TX_BUFFER(i_Command, 1);
-    i_Command.AppendUint8(u8_Command);
-  
-    return DataExchange(&i_Command, pi_Params, u8_RecvBuf, s32_RecvSize, pe_Status, e_Mac);
-}
-int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + params that are not encrypted)
-                          TxBuffer* pi_Params,                // in (parameters that may be encrypted)
-                          byte* u8_RecvBuf, int s32_RecvSize, // out
-                          DESFireStatus* pe_Status,           // out
-                          DESFireCmac    e_Mac)               // in
+bool Desfire::SendFileData(byte u8_Command, TxBuffer* pi_Header, const byte* u8_Data, int s32_Length, DESFireFileEncryption e_Mode)
 {
-    if (pe_Status) *pe_Status = ST_Success;
-    mu8_LastPN532Error = 0;
+    // The bytes that follow the data: CMAC or CRC32 + padding
+    byte u8_Tail[24] = {0};
+    int  s32_Total = s32_Length;
+    int  s32_BlockSize = 1;
 
-    TX_BUFFER(i_Empty, 1);
-    if (pi_Params == NULL)
-        pi_Params = &i_Empty;
+    if (mpk_Session->u8_LastAuthKeyNo == NOT_AUTHENTICATED)
+        e_Mode = CM_PLAIN;
 
-    // The response for INDATAEXCHANGE is always: 
-    // - 0xD5
-    // - 0x41
-    // - Status byte from PN532        (0 if no error)
-    // - Status byte from Desfire card (0 if no error)
-    // - data bytes ...
-    int s32_Overhead = 11; // Overhead added to payload = 11 bytes = 7 bytes for PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
-    if (e_Mac & MAC_Rmac) s32_Overhead += 8; // + 8 bytes for CMAC
-  
-    // mu8_PacketBuffer is used for input and output
-    if (2 + pi_Command->GetCount() + pi_Params->GetCount() > PN532_PACKBUFFSIZE || s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE)    
+    if (e_Mode == CM_ENCRYPT)
     {
-        Utils::Print("DataExchange(): Invalid parameters\r\n");
-        return -1;
-    }
+        DESFireKey* pi_Key = mpk_Session->pi_SessionKey;
+        uint32_t u32_Crc = Utils::CalcCrc32(&u8_Command, 1, pi_Header->GetData(), pi_Header->GetCount());
+        u32_Crc = Utils::CalcCrc32(u8_Data, s32_Length, u32_Crc);
+        memcpy(u8_Tail, &u32_Crc, 4);
 
-    if (e_Mac & (MAC_Tcrypt | MAC_Rcrypt))
+        s32_BlockSize = pi_Key->GetBlockSize();
+        s32_Total     = pi_Key->CalcPaddedBlockSize(s32_Length + 4);
+    }
+    else if (mpk_Session->u8_LastAuthKeyNo != NOT_AUTHENTICATED)
     {
-        if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
-        {
-            Utils::Print("Not authenticated\r\n");
-            return -1;
-        }
+        // The CMAC must be calculated even if it is not transmitted (CM_PLAIN) because it maintains the IV up to date.
+        DESFireKey* pi_Key = mpk_Session->pi_SessionKey;
+        pi_Key->CmacBegin();
+        if (!pi_Key->CmacUpdate(&u8_Command, 1) ||
+            !pi_Key->CmacUpdate(pi_Header->GetData(), pi_Header->GetCount()) ||
+            !pi_Key->CmacUpdate(u8_Data, s32_Length) ||
+            !pi_Key->CmacFinal(u8_Tail))
+            return false;
+
+        if (e_Mode == CM_MAC)
+            s32_Total += 8; // For AES the CMAC is 16 byte, but only 8 are transmitted
     }
 
-    if (e_Mac & MAC_Tcrypt) // CRC and encrypt pi_Params
+    TX_BUFFER(i_Params, MAX_EXCHANGE_SIZE); 
+    i_Params.AppendBuf(pi_Header->GetData(), pi_Header->GetCount());
+
+    int s32_Pos = 0;
+    while (true)
     {
-        if (mu8_DebugLevel > 0)
-        {
-            Utils::Print("* Sess Key IV: ");
-            mpi_SessionKey->PrintIV(LF);
-        }    
-    
-        // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
-        uint32_t u32_Crc = Utils::CalcCrc32(pi_Command->GetData(), pi_Command->GetCount(), pi_Params->GetData(), pi_Params->GetCount());
-        if (!pi_Params->AppendUint32(u32_Crc))
-            return -1; // buffer overflow
-    
-        int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(pi_Params->GetCount());
-        if (!pi_Params->SetCount(s32_CryptCount))
-            return -1; // buffer overflow
-    
-        if (mu8_DebugLevel > 0)
+        // 1 byte for the command. Encrypted data is sent in entire blocks.
+        int s32_Count = min(s32_Total - s32_Pos, GetFrameSize() - 1 - i_Params.GetCount());
+        if (s32_Pos + s32_Count < s32_Total)
+            s32_Count -= s32_Count % s32_BlockSize;
+
+        if (s32_Count <= 0 && s32_Pos < s32_Total)
         {
-            Utils::Print("* CRC Params:  0x");
-            Utils::PrintHex32(u32_Crc, LF);
-            Utils::Print("* Params:      ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
+            Utils::Print("SendFileData(): Frame too small\r\n");
+            return false;
         }
-    
-        if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, pi_Params->GetData(), pi_Params->GetData(), s32_CryptCount))
-            return -1;
-    
-        if (mu8_DebugLevel > 0)
+
+        byte* u8_Chunk = i_Params + i_Params.GetCount();
+        int s32_Data   = max(0, min(s32_Count, s32_Length - s32_Pos)); // from u8_Data
+        if (s32_Data > 0)         i_Params.AppendBuf(u8_Data + s32_Pos, s32_Data);
+        if (s32_Count > s32_Data) i_Params.AppendBuf(u8_Tail + s32_Pos + s32_Data - s32_Length, s32_Count - s32_Data);
+
+        if (e_Mode == CM_ENCRYPT && s32_Count > 0)
         {
-            Utils::Print("* Params_enc:  ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }    
-    }
+            if (!mpk_Session->pi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Chunk, u8_Chunk, s32_Count))
+                return false;
+        }
+        s32_Pos += s32_Count;
 
-    byte u8_Command = pi_Command->GetData()[0];
+        // The TX CMAC has already been calculated above over the entire message (or the encryption has updated the IV)
+        DESFireStatus e_Status;
+        int s32_Read = DataExchange(u8_Command, &i_Params, NULL, 0, &e_Status, (s32_Pos == s32_Total) ? MAC_Rmac : MAC_None);
+        if (s32_Read != 0)
+            return false;
 
-    byte u8_CalcMac[16];
-    if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it 
-        (u8_Command != DF_INS_ADDITIONAL_FRAME) &&  // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
-        (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))   // No session key -> no CMAC calculation possible
-    { 
-        mi_CmacBuffer.Clear();
-        if (!mi_CmacBuffer.AppendBuf(pi_Command->GetData(), pi_Command->GetCount()) ||
-            !mi_CmacBuffer.AppendBuf(pi_Params ->GetData(), pi_Params ->GetCount()))
-            return -1;
-      
-        // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
-        // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
-        if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
-            return -1;
+        if (s32_Pos == s32_Total)
+            return (e_Status == ST_Success);
 
-        if (mu8_DebugLevel > 1)
+        if (e_Status != ST_MoreFrames)
+            return false;
+
+        u8_Command = DF_INS_ADDITIONAL_FRAME;
+        i_Params.Clear();
+    }
+}
+
+/**************************************************************************
+    Sends a command that reads encrypted data from a file and decrypts the response.
+    The card sends: encrypted (data + CRC32 + zero padding) in one or more frames.
+    The CRC32 is calculated over the data and the status byte.
+    Each frame is decrypted block by block while it arrives (a block may be split over two frames)
+    directly into u8_Data. Only the last block with CRC and padding is decrypted into a temporary block.
+    If pk_Sink is set, the data is passed record by record to the callback instead of u8_Data.
+**************************************************************************/
+bool Desfire::ReceiveEncrypted(byte u8_Command, TxBuffer* pi_Params, byte* u8_Data, int s32_Length, kDesfireRecordSink* pk_Sink)
+{
+    DESFireKey* pi_Key = mpk_Session->pi_SessionKey;
+    int s32_BlockSize  = pi_Key->GetBlockSize();
+    int s32_Total      = pi_Key->CalcPaddedBlockSize(s32_Length + 4);
+    int s32_Pos        = 0;  // the decrypted bytes
+    int s32_Fill       = 0;  // the bytes in u8_Block
+    byte u8_Block[16];       // a block that is split over two frames
+    byte u8_Tail[24];        // the decrypted CRC32 + padding
+    byte u8_Plain[16];
+    uint32_t u32_Crc   = 0xFFFFFFFF;
+
+    // The TX CMAC over the command brings the IV up to date for the decryption
+    DESFireCmac   e_Mac    = MAC_Tmac;
+    DESFireStatus e_Status = ST_MoreFrames;
+    while (e_Status == ST_MoreFrames)
+    {
+        int s32_Read = DataExchange(u8_Command, pi_Params, NULL, MAX_EXCHANGE_SIZE, &e_Status, e_Mac);
+        if (s32_Read < 0)
+            return false;
+
+        if (s32_Pos + s32_Fill + s32_Read > s32_Total)
         {
-            Utils::Print("TX CMAC:  ");
-            Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
+            Utils::Print("ReceiveEncrypted(): Invalid length\r\n");
+            return false;
         }
-    }
 
-    int P=0;
-    mu8_PacketBuffer[P++] = PN532_COMMAND_INDATAEXCHANGE;
-    mu8_PacketBuffer[P++] = 1; // Card number (Logical target number)
+        const byte* u8_Response = GetResponseData();
+        while (s32_Read > 0)
+        {
+            int s32_Copy = min(s32_Read, s32_BlockSize - s32_Fill);
+            memcpy(u8_Block + s32_Fill, u8_Response, s32_Copy);
+            u8_Response += s32_Copy;
+            s32_Read    -= s32_Copy;
+            s32_Fill    += s32_Copy;
+            if (s32_Fill < s32_BlockSize)
+                break;
 
-    memcpy(mu8_PacketBuffer + P, pi_Command->GetData(), pi_Command->GetCount());
-    P += pi_Command->GetCount();
+            // Blocks that contain only data are decrypted directly into u8_Data
+            bool  b_Direct = (pk_Sink == NULL && s32_Pos + s32_BlockSize <= s32_Length);
+            byte* u8_Out   = b_Direct ? u8_Data + s32_Pos : u8_Plain;
+            if (!pi_Key->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Out, u8_Block, s32_BlockSize))
+                return false;
 
-    memcpy(mu8_PacketBuffer + P, pi_Params->GetData(),  pi_Params->GetCount());
-    P += pi_Params->GetCount();
+            // The count of data bytes in this block, the rest is CRC and padding
+            int s32_Data = max(0, min(s32_BlockSize, s32_Length - s32_Pos));
+            u32_Crc = Utils::CalcCrc32(u8_Out, s32_Data, u32_Crc);
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, P))
-        return -1;
+            if (!b_Direct)
+            {
+                if (pk_Sink) PutRecordData(pk_Sink, u8_Plain, s32_Data);
+                else         memcpy(u8_Data + s32_Pos, u8_Plain, s32_Data);
 
-    byte s32_Len = ReadData(mu8_PacketBuffer, s32_RecvSize + s32_Overhead);
+                if (s32_Data < s32_BlockSize)
+                    memcpy(u8_Tail + s32_Pos + s32_Data - s32_Length, u8_Plain + s32_Data, s32_BlockSize - s32_Data);
+            }
+            s32_Pos += s32_BlockSize;
+            s32_Fill = 0;
+        }
 
-    // ReadData() returns 3 byte if status error from the PN532
-    // ReadData() returns 4 byte if status error from the Desfire card
-    if (s32_Len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1)
-    {
-        Utils::Print("DataExchange() failed\r\n");
-        return -1;
+        u8_Command = DF_INS_ADDITIONAL_FRAME;
+        pi_Params  = NULL;
+        e_Mac      = MAC_None;
     }
 
-    // Here we get two status bytes that must be checked
-    byte u8_PN532Status = mu8_PacketBuffer[2]; // contains errors from the PN532
-    byte u8_CardStatus  = mu8_PacketBuffer[3]; // contains errors from the Desfire card
+    if (s32_Pos != s32_Total)
+    {
+        Utils::Print("ReceiveEncrypted(): Invalid length\r\n");
+        return false;
+    }
 
-    mu8_LastPN532Error = u8_PN532Status;
+    // The CRC is calculated over the data + the status byte
+    byte u8_Status = ST_Success;
+    u32_Crc = Utils::CalcCrc32(&u8_Status, 1, u32_Crc);
+    bool b_Valid = (memcmp(u8_Tail, &u32_Crc, 4) == 0);
+    for (int i=4; i<s32_Total - s32_Length; i++)
+    {
+        b_Valid &= (u8_Tail[i] == 0);
+    }
 
-    if (!CheckPN532Status(u8_PN532Status) || s32_Len < 4)
-        return -1;
+    if (mu8_DebugLevel > 1 && pk_Sink == NULL)
+    {
+        Utils::Print("Decrypt:  ");
+        Utils::PrintHexBuf(u8_Data, s32_Length, LF);
+    }
 
-    // After any error that the card has returned the authentication is invalidated.
-    // The card does not send any CMAC anymore until authenticated anew.
-    if (u8_CardStatus != ST_Success && u8_CardStatus != ST_MoreFrames)
+    if (!b_Valid)
     {
-        mu8_LastAuthKeyNo = NOT_AUTHENTICATED; // A new authentication is required now
+        Utils::Print("CRC Mismatch\r\n");
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************
+    Reads the value of a Value File
+**************************************************************************/
+bool Desfire::ReadFileValue(byte u8_FileID, uint32_t* pu32_Value)
+{
+    DESFireFileEncryption e_Mode;
+    if (!GetFileMode(u8_FileID, false, &e_Mode))
+        return false;
+
+    TX_BUFFER(i_Params, 1);
+    i_Params.AppendUint8(u8_FileID);
+
+    RX_BUFFER(i_RetData, 4);
+    if (e_Mode == CM_ENCRYPT)
+    {
+        if (!ReceiveEncrypted(DF_INS_GET_VALUE, &i_Params, i_RetData, 4))
+            return false;
+    }
+    else if (4 != DataExchange(DF_INS_GET_VALUE, &i_Params, i_RetData, 4, NULL, MAC_TmacRmac))
+        return false;
+
+    *pu32_Value = i_RetData.ReadUint32();
+    return true;
+}
+
+/**************************************************************************
+    Increases the value of a Value File (requires the key in e_ReadAndWriteAccess).
+    Debit() decreases the value (requires e_ReadAccess, e_WriteAccess or e_ReadAndWriteAccess).
+    LimitedCredit() undoes a Debit() up to the debited amount (requires e_WriteAccess or e_ReadAndWriteAccess).
+    The value is transferred in the communication mode of the file.
+    The change becomes valid only after CommitTransaction().
+    Use DESFireTransaction to execute several changes with one commit.
+**************************************************************************/
+bool Desfire::Credit(byte u8_FileID, int s32_Value)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** Credit(ID= %d, Value= %d)\r\n", u8_FileID, s32_Value);
+        Utils::Print(s8_Buf);
+    }
+    return ChangeValue(DF_INS_CREDIT, u8_FileID, s32_Value);
+}
+
+bool Desfire::Debit(byte u8_FileID, int s32_Value)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** Debit(ID= %d, Value= %d)\r\n", u8_FileID, s32_Value);
+        Utils::Print(s8_Buf);
+    }
+    return ChangeValue(DF_INS_DEBIT, u8_FileID, s32_Value);
+}
+
+bool Desfire::LimitedCredit(byte u8_FileID, int s32_Value)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** LimitedCredit(ID= %d, Value= %d)\r\n", u8_FileID, s32_Value);
+        Utils::Print(s8_Buf);
+    }
+    return ChangeValue(DF_INS_LIMITED_CREDIT, u8_FileID, s32_Value);
+}
+
+// Credit, Debit and LimitedCredit send: u8_FileID + s32_Value (secured like the data of WriteFileData())
+bool Desfire::ChangeValue(byte u8_Command, byte u8_FileID, int s32_Value)
+{
+    if (s32_Value < 0)
+    {
+        Utils::Print("Invalid value\r\n");
+        return false;
+    }
+
+    DESFireFileEncryption e_Mode;
+    if (!GetFileMode(u8_FileID, true, &e_Mode))
+        return false;
+
+    TX_BUFFER(i_Header, 1);
+    i_Header.AppendUint8(u8_FileID);
+
+    byte u8_Value[4];
+    memcpy(u8_Value, &s32_Value, 4); // LSB first
+
+    return SendFileData(u8_Command, &i_Header, u8_Value, 4, e_Mode);
+}
+
+/**************************************************************************
+    Creates a linear record file in the selected application.
+    WriteRecord() appends a new record until s32_MaxRecords are stored. Then the file is full until ClearRecordFile().
+**************************************************************************/
+bool Desfire::CreateLinearRecordFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_RecordSize, int s32_MaxRecords, DESFireFileEncryption e_Encrypt)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** CreateLinearRecordFile(ID= %d, Size= %d, Records= %d)\r\n", u8_FileID, s32_RecordSize, s32_MaxRecords);
+        Utils::Print(s8_Buf);
+    }
+
+    return CreateRecordFile(DF_INS_CREATE_LINEAR_RECORD_FILE, u8_FileID, pk_Permis, s32_RecordSize, s32_MaxRecords, e_Encrypt);
+}
+
+/**************************************************************************
+    Creates a cyclic record file in the selected application (e.g. for an access log).
+    When the file is full, WriteRecord() overwrites the oldest record.
+    ATTENTION: One record is reserved by the card: s32_MaxRecords must be one more than the records to keep.
+**************************************************************************/
+bool Desfire::CreateCyclicRecordFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_RecordSize, int s32_MaxRecords, DESFireFileEncryption e_Encrypt)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** CreateCyclicRecordFile(ID= %d, Size= %d, Records= %d)\r\n", u8_FileID, s32_RecordSize, s32_MaxRecords);
+        Utils::Print(s8_Buf);
+    }
+
+    return CreateRecordFile(DF_INS_CREATE_CYCLIC_RECORD_FILE, u8_FileID, pk_Permis, s32_RecordSize, s32_MaxRecords, e_Encrypt);
+}
+
+bool Desfire::CreateRecordFile(byte u8_Command, byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_RecordSize, int s32_MaxRecords, DESFireFileEncryption e_Encrypt)
+{
+    uint16_t u16_Permis = pk_Permis->Pack();
+  
+    TX_BUFFER(i_Params, 10);
+    i_Params.AppendUint8 (u8_FileID);
+    i_Params.AppendUint8 (e_Encrypt);
+    i_Params.AppendUint16(u16_Permis);
+    i_Params.AppendUint24(s32_RecordSize); // only the low 3 bytes are used
+    i_Params.AppendUint24(s32_MaxRecords); // only the low 3 bytes are used
+
+    ForgetFileModes(u8_FileID);
+    return (0 == DataExchange(u8_Command, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+}
+
+/**************************************************************************
+    Writes data into a new record (s32_Offset and s32_Length within the record) of a Linear or Cyclic Record File.
+    Several calls for the same file before CommitTransaction() write into the same new record.
+    The record becomes valid only after CommitTransaction() (see DESFireTransaction).
+**************************************************************************/
+bool Desfire::WriteRecord(byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** WriteRecord(ID= %d, Offset= %d, Length= %d)\r\n", u8_FileID, s32_Offset, s32_Length);
+        Utils::Print(s8_Buf);
+    }
+
+    DESFireFileEncryption e_Mode;
+    if (!GetFileMode(u8_FileID, true, &e_Mode))
+        return false;
+
+    TX_BUFFER(i_Header, 7); 
+    i_Header.AppendUint8 (u8_FileID);
+    i_Header.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Header.AppendUint24(s32_Length); // only the low 3 bytes are used
+
+    return SendFileData(DF_INS_WRITE_RECORD, &i_Header, u8_DataBuffer, s32_Length, e_Mode);
+}
+
+/**************************************************************************
+    Reads s32_Count records (0 = all) of a Linear or Cyclic Record File with one command.
+    s32_Offset = 0 starts with the newest record, s32_Offset = 1 with the record before it, etc.
+    The card sends the records in chronological order (the oldest first) in several frames.
+    Each record is passed to f_Callback as soon as it has arrived, so u8_RecordBuf needs space for only one record.
+    The CMAC (or the CRC of encrypted files) is calculated while the frames arrive and verified after the last frame.
+    ATTENTION: If ReadRecords() returns false, discard all records that have been passed to f_Callback.
+    For encrypted files s32_Count must not be 0 because the position of the CRC must be known.
+**************************************************************************/
+bool Desfire::ReadRecords(byte u8_FileID, int s32_Offset, int s32_Count, byte* u8_RecordBuf, int s32_RecordSize, DESFireRecordCallback f_Callback, void* p_Context)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** ReadRecords(ID= %d, Offset= %d, Count= %d)\r\n", u8_FileID, s32_Offset, s32_Count);
+        Utils::Print(s8_Buf);
+    }
+
+    if (s32_RecordSize <= 0)
+    {
+        Utils::Print("Invalid record size\r\n");
+        return false;
+    }
+
+    DESFireFileEncryption e_Mode;
+    if (!GetFileMode(u8_FileID, false, &e_Mode))
+        return false;
+
+    kDesfireRecordSink k_Sink;
+    k_Sink.f_Callback     = f_Callback;
+    k_Sink.p_Context      = p_Context;
+    k_Sink.u8_Record      = u8_RecordBuf;
+    k_Sink.s32_RecordSize = s32_RecordSize;
+    k_Sink.s32_Fill       = 0;
+    k_Sink.s32_Index      = 0;
+
+    TX_BUFFER(i_Params, 7);
+    i_Params.AppendUint8 (u8_FileID);
+    i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
+
+    if (e_Mode == CM_ENCRYPT)
+    {
+        if (s32_Count == 0)
+        {
+            Utils::Print("ReadRecords(): Count required\r\n");
+            return false;
+        }
+        return ReceiveEncrypted(DF_INS_READ_RECORDS, &i_Params, NULL, s32_Count * s32_RecordSize, &k_Sink);
+    }
+
+    // CM_PLAIN and CM_MAC: the card appends a CMAC to the last frame (see ReadFileData())
+    byte          u8_Command = DF_INS_READ_RECORDS;
+    TxBuffer*     pi_Params  = &i_Params;
+    DESFireCmac   e_Mac      = MAC_TmacRmac;
+    DESFireStatus e_Status   = ST_MoreFrames;
+    while (e_Status == ST_MoreFrames)
+    {
+        int s32_Read = DataExchange(u8_Command, pi_Params, NULL, MAX_EXCHANGE_SIZE, &e_Status, e_Mac);
+        if (s32_Read < 0)
+            return false;
+
+        PutRecordData(&k_Sink, GetResponseData(), s32_Read);
+
+        u8_Command = DF_INS_ADDITIONAL_FRAME;
+        pi_Params  = NULL;
+        e_Mac      = MAC_RmacRchain;
+    }
+
+    return (k_Sink.s32_Fill == 0 && (s32_Count == 0 || k_Sink.s32_Index == s32_Count));
+}
+
+// Collects the bytes of one record and passes each complete record to the callback
+void Desfire::PutRecordData(kDesfireRecordSink* pk_Sink, const byte* u8_Data, int s32_Length)
+{
+    while (s32_Length > 0)
+    {
+        int s32_Copy = min(s32_Length, pk_Sink->s32_RecordSize - pk_Sink->s32_Fill);
+        memcpy(pk_Sink->u8_Record + pk_Sink->s32_Fill, u8_Data, s32_Copy);
+        pk_Sink->s32_Fill += s32_Copy;
+        u8_Data           += s32_Copy;
+        s32_Length        -= s32_Copy;
+
+        if (pk_Sink->s32_Fill == pk_Sink->s32_RecordSize)
+        {
+            pk_Sink->f_Callback(pk_Sink->p_Context, pk_Sink->s32_Index++, pk_Sink->u8_Record, pk_Sink->s32_RecordSize);
+            pk_Sink->s32_Fill = 0;
+        }
+    }
+}
+
+/**************************************************************************
+    Deletes all records of a Linear or Cyclic Record File.
+    The file is empty only after CommitTransaction().
+**************************************************************************/
+bool Desfire::ClearRecordFile(byte u8_FileID)
+{
+    if (mu8_DebugLevel > 0)
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "\r\n*** ClearRecordFile(ID= %d)\r\n", u8_FileID);
+        Utils::Print(s8_Buf);
+    }
+
+    TX_BUFFER(i_Params, 1);
+    i_Params.AppendUint8(u8_FileID);
+
+    return (0 == DataExchange(DF_INS_CLEAR_RECORD_FILE, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+}
+
+/**************************************************************************
+    Validates all changes of Value Files, Backup Data Files and Record Files in the selected application.
+**************************************************************************/
+bool Desfire::CommitTransaction()
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** CommitTransaction()\r\n");
+
+    return (0 == DataExchange(DF_COMMIT_TRANSACTION, NULL, NULL, 0, NULL, MAC_TmacRmac));
+}
+
+/**************************************************************************
+    Discards all changes of Value Files, Backup Data Files and Record Files in the selected application.
+**************************************************************************/
+bool Desfire::AbortTransaction()
+{
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** AbortTransaction()\r\n");
+
+    return (0 == DataExchange(DF_INS_ABORT_TRANSACTION, NULL, NULL, 0, NULL, MAC_TmacRmac));
+}
+
+/**************************************************************************
+    Sends all changes that have been collected in pi_Transaction and commits them at once.
+    If one of the changes fails, all changes are discarded:
+    After an error the card has invalidated the authentication and aborts the transaction itself
+    when the next authentication or SelectApplication() follows. 
+    Nevertheless AbortTransaction() is sent to discard the changes immediately.
+    A transaction that has lost changes because it was full is refused before anything is sent.
+**************************************************************************/
+bool Desfire::ExecuteTransaction(DESFireTransaction* pi_Transaction)
+{
+    if (pi_Transaction->IsOverflow())
+    {
+        Utils::Print("ExecuteTransaction(): Too many changes\r\n");
+        return false;
+    }
+
+    for (int i=0; i<pi_Transaction->GetCount(); i++)
+    {
+        const kDesfireTxStep* pk_Step = pi_Transaction->GetStep(i);
+
+        bool b_Success = false;
+        switch (pk_Step->e_Operation)
+        {
+            case TXOP_Credit:        b_Success = Credit       (pk_Step->u8_FileID, pk_Step->s32_Value); break;
+            case TXOP_Debit:         b_Success = Debit        (pk_Step->u8_FileID, pk_Step->s32_Value); break;
+            case TXOP_LimitedCredit: b_Success = LimitedCredit(pk_Step->u8_FileID, pk_Step->s32_Value); break;
+            case TXOP_WriteData:     b_Success = WriteFileData(pk_Step->u8_FileID, pk_Step->s32_Value, pk_Step->s32_Length, pk_Step->u8_Data); break;
+            case TXOP_WriteRecord:   b_Success = WriteRecord  (pk_Step->u8_FileID, pk_Step->s32_Value, pk_Step->s32_Length, pk_Step->u8_Data); break;
+        }
+
+        if (!b_Success)
+        {
+            AbortTransaction();
+            return false;
+        }
+    }
+    return CommitTransaction();
+}
+
+// ########################################################################
+// ####                      LOW LEVEL FUNCTIONS                      #####
+// ########################################################################
+
+// If this value is != 0, the PN532 has returned an error code while executing the latest command.
+// Typically a Timeout error (Value = 0x01) means that the card is too far away from the reader.
+// Interestingly a timeout occurres typically when authenticating. 
+// The commands that are executed first (GetKeyVersion and SelectApplication) execute without problems.
+// But it when it comes to Authenticate() the card suddenly does not respond anymore -> Timeout from PN532.
+// Conclusion: It seems that a Desfire card increases its power consumption in the moment when encrypting data,
+// so when it is too far away from the antenna -> the connection dies -> no answer -> timeout.
+// PN532::TuneRf() finds the receiver gain and antenna driver setting with the fewest timeouts.
+byte Desfire::GetLastPN532Error()
+{
+    return mu8_LastPN532Error;
+}
+
+/**************************************************************************
+    Sends data to the card and receives the response.
+    u8_Command    = Desfire command without additional paramaters
+    pi_Command    = Desfire command + possible additional paramaters that will not be encrypted
+    pi_Params     = Desfire command parameters that may be encrypted (MAC_Tcrypt). This paramater may also be null.
+    u8_RecvBuf    = buffer that receives the received data (should be the size of the expected recv data)
+   s32_RecvSize   = buffer size of u8_RecvBuf
+    pe_Status     = if (!= NULL) -> receives the status byte
+    e_Mac         = defines CMAC calculation
+    returns the byte count that has been read into u8_RecvBuf or -1 on error
+    This function blocks until the response has been received.
+    StartDataExchange() and FinishDataExchange() do the same without blocking.
+**************************************************************************/
+int Desfire::DataExchange(byte u8_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac)
+{
+    TX_BUFFER(i_Command, 1);
+    i_Command.AppendUint8(u8_Command);
+  
+    return DataExchange(&i_Command, pi_Params, u8_RecvBuf, s32_RecvSize, pe_Status, e_Mac);
+}
+int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + params that are not encrypted)
+                          TxBuffer* pi_Params,                // in (parameters that may be encrypted)
+                          byte* u8_RecvBuf, int s32_RecvSize, // out
+                          DESFireStatus* pe_Status,           // out
+                          DESFireCmac    e_Mac)               // in
+{
+    if (!StartDataExchange(pi_Command, pi_Params, u8_RecvBuf, s32_RecvSize, pe_Status, e_Mac))
+        return -1;
+
+    WaitCommand();
+    return FinishDataExchange();
+}
+
+/**************************************************************************
+    The first half of DataExchange(): encrypts the parameters, calculates the TX CMAC 
+    and sends the command to the PN532 without waiting for the response.
+    Then call PollCommand() until it does not return JOB_Busy anymore and finally FinishDataExchange().
+    This allows to execute Desfire commands as resumable jobs while the main loop keeps running.
+    ATTENTION: u8_RecvBuf and pe_Status must stay valid until FinishDataExchange() has been called.
+    returns false on error (nothing has been sent in this case)
+**************************************************************************/
+bool Desfire::StartDataExchange(TxBuffer* pi_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac)
+{
+    if (pe_Status) *pe_Status = ST_Success;
+    mu8_LastPN532Error = 0;
+
+    TX_BUFFER(i_Empty, 1);
+    if (pi_Params == NULL)
+        pi_Params = &i_Empty;
+
+    // The response for INDATAEXCHANGE is always: 
+    // - 0xD5
+    // - 0x41
+    // - Status byte from PN532        (0 if no error)
+    // - Status byte from Desfire card (0 if no error)
+    // - data bytes ...
+    int s32_Overhead = PN532_FRAME_OVERHEAD + 4; // Overhead added to payload = PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
+    if (e_Mac & MAC_Rmac) s32_Overhead += 8; // + 8 bytes for CMAC
+  
+    // mu8_PacketBuffer is used for input and output
+    if (2 + pi_Command->GetCount() + pi_Params->GetCount() > PN532_PACKBUFFSIZE || s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE)    
+    {
+        Utils::Print("DataExchange(): Invalid parameters\r\n");
+        return false;
+    }
+
+    if (e_Mac & (MAC_Tcrypt | MAC_Rcrypt))
+    {
+        if (mpk_Session->u8_LastAuthKeyNo == NOT_AUTHENTICATED)
+        {
+            Utils::Print("Not authenticated\r\n");
+            return false;
+        }
+    }
+
+    // The command and the parameters are copied only once: directly behind the INDATAEXCHANGE header in mu8_PacketBuffer.
+    // The parameters are encrypted in place and WriteCommand() builds the PN532 frame around them.
+    byte* u8_Command = mu8_PacketBuffer + 2;
+    int s32_CmdLen   = pi_Command->GetCount();
+    byte* u8_Params  = u8_Command + s32_CmdLen;
+    int s32_ParamLen = pi_Params->GetCount();
+
+    memcpy(u8_Command, pi_Command->GetData(), s32_CmdLen);
+    memcpy(u8_Params,  pi_Params ->GetData(), s32_ParamLen);
+
+    if (e_Mac & MAC_Tcrypt) // CRC and encrypt the parameters
+    {
+        if (mu8_DebugLevel > 0)
+        {
+            Utils::Print("* Sess Key IV: ");
+            mpk_Session->pi_SessionKey->PrintIV(LF);
+        }    
+    
+        // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
+        uint32_t u32_Crc = Utils::CalcCrc32(u8_Command, s32_CmdLen, u8_Params, s32_ParamLen);
+
+        int s32_CryptCount = mpk_Session->pi_SessionKey->CalcPaddedBlockSize(s32_ParamLen + 4);
+        if (2 + s32_CmdLen + s32_CryptCount > PN532_PACKBUFFSIZE)
+        {
+            Utils::Print("DataExchange(): Invalid parameters\r\n");
+            return false;
+        }
+
+        // Append the CRC and pad with zeroes up to the block size
+        memcpy(u8_Params + s32_ParamLen, &u32_Crc, 4);
+        memset(u8_Params + s32_ParamLen + 4, 0, s32_CryptCount - s32_ParamLen - 4);
+        s32_ParamLen = s32_CryptCount;
+    
+        if (mu8_DebugLevel > 0)
+        {
+            Utils::Print("* CRC Params:  0x");
+            Utils::PrintHex32(u32_Crc, LF);
+            Utils::Print("* Params:      ");
+            Utils::PrintHexBuf(u8_Params, s32_CryptCount, LF);
+        }
+    
+        if (!mpk_Session->pi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Params, u8_Params, s32_CryptCount))
+            return false;
+    
+        if (mu8_DebugLevel > 0)
+        {
+            Utils::Print("* Params_enc:  ");
+            Utils::PrintHexBuf(u8_Params, s32_CryptCount, LF);
+        }    
+    }
+
+    byte u8_CalcMac[16];
+    if ((e_Mac & MAC_Tmac) &&                                // Calculate the TX CMAC only if the caller requests it 
+        (u8_Command[0] != DF_INS_ADDITIONAL_FRAME) &&        // A command sent in several frames is MACed by the caller (see SendFileData())
+        (mpk_Session->u8_LastAuthKeyNo != NOT_AUTHENTICATED)) // No session key -> no CMAC calculation possible
+    { 
+        // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
+        // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
+        // The CMAC is calculated directly from the packet buffer.
+        mpk_Session->pi_SessionKey->CmacBegin();
+        if (!mpk_Session->pi_SessionKey->CmacUpdate(u8_Command, s32_CmdLen + s32_ParamLen) ||
+            !mpk_Session->pi_SessionKey->CmacFinal(u8_CalcMac))
+            return false;
+
+        if (mu8_DebugLevel > 1)
+        {
+            Utils::Print("TX CMAC:  ");
+            Utils::PrintHexBuf(u8_CalcMac, mpk_Session->pi_SessionKey->GetBlockSize(), LF);
+        }
+    }
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_INDATAEXCHANGE;
+    mu8_PacketBuffer[1] = mu8_Target; // Card number (Logical target number, see SetTarget())
+    int P = 2 + s32_CmdLen + s32_ParamLen;
+
+    // Each command class has its own deadline (see SetExchangeTimeout())
+    me_LastTimeout = GetTimeoutClass(u8_Command[0]);
+    if (!StartCommand(mu8_PacketBuffer, P, GetExchangeTimeout(me_LastTimeout)))
+        return false;
+
+    mk_Exchange.u8_RecvBuf   = u8_RecvBuf;
+    mk_Exchange.s32_RecvSize = s32_RecvSize;
+    mk_Exchange.pe_Status    = pe_Status;
+    mk_Exchange.e_Mac        = e_Mac;
+    return true;
+}
+
+/**************************************************************************
+    The second half of DataExchange(): checks the status, verifies the RX CMAC 
+    and copies (and decrypts) the response into the buffer that was passed to StartDataExchange().
+    returns the byte count that has been read into u8_RecvBuf or -1 on error
+**************************************************************************/
+int Desfire::FinishDataExchange()
+{
+    byte*          u8_RecvBuf   = mk_Exchange.u8_RecvBuf;
+    int            s32_RecvSize = mk_Exchange.s32_RecvSize;
+    DESFireStatus* pe_Status    = mk_Exchange.pe_Status;
+    DESFireCmac    e_Mac        = mk_Exchange.e_Mac;
+    byte           u8_CalcMac[16];
+
+    int s32_Len = FinishCommand();
+
+    // ReadData() returns 3 byte if status error from the PN532
+    // ReadData() returns 4 byte if status error from the Desfire card
+    if (s32_Len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1)
+    {
+        Utils::Print("DataExchange() failed\r\n");
+        return -1;
+    }
+
+    // Here we get two status bytes that must be checked
+    byte u8_PN532Status = mu8_PacketBuffer[2]; // contains errors from the PN532
+    byte u8_CardStatus  = mu8_PacketBuffer[3]; // contains errors from the Desfire card
+
+    mu8_LastPN532Error = u8_PN532Status;
+
+    if (!CheckPN532Status(u8_PN532Status) || s32_Len < 4)
+        return -1;
+
+    // After any error that the card has returned the authentication is invalidated.
+    // The card does not send any CMAC anymore until authenticated anew.
+    if (u8_CardStatus != ST_Success && u8_CardStatus != ST_MoreFrames)
+    {
+        mpk_Session->u8_LastAuthKeyNo = NOT_AUTHENTICATED; // A new authentication is required now
     }
 
     if (!CheckCardStatus((DESFireStatus)u8_CardStatus))
@@ -1176,21 +2002,22 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
     // If the IV is out of sync with the IV in the card, the next encryption with the session key will result in an Integrity Error.
     if ((e_Mac & MAC_Rmac) &&                                              // Calculate RX CMAC only if the caller requests it
         (u8_CardStatus == ST_Success || u8_CardStatus == ST_MoreFrames) && // In case of an error there is no CMAC in the response
-        (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))                          // No session key -> no CMAC calculation possible
+        (mpk_Session->u8_LastAuthKeyNo != NOT_AUTHENTICATED))              // No session key -> no CMAC calculation possible
     {
         // For example GetCardVersion() calls DataExchange() 3 times:
-        // 1. u8_Command = DF_INS_GET_VERSION      -> clear CMAC buffer + append received data
-        // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        if (u8_Command != DF_INS_ADDITIONAL_FRAME)
+        // 1. MAC_TmacRmac   -> begin a new CMAC + absorb received data
+        // 2. MAC_RmacRchain -> absorb received data
+        // 3. MAC_RmacRchain -> absorb received data + status and verify the CMAC
+        // The last frame of SendFileData() is also sent with DF_INS_ADDITIONAL_FRAME, but its response begins a new CMAC.
+        if ((e_Mac & MAC_Rchain) == 0)
         {
-            mi_CmacBuffer.Clear();
+            mpk_Session->pi_SessionKey->CmacBegin();
         }
 
         // This is an intermediate frame. More frames will follow. There is no CMAC in the response yet.
         if (u8_CardStatus == ST_MoreFrames)
         {
-            if (!mi_CmacBuffer.AppendBuf(mu8_PacketBuffer + 4, s32_Len))
+            if (!mpk_Session->pi_SessionKey->CmacUpdate(mu8_PacketBuffer + 4, s32_Len))
                 return -1;
         }
         
@@ -1202,17 +2029,15 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
             byte* u8_RxMac = mu8_PacketBuffer + 4 + s32_Len;
             
             // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
-            if (!mi_CmacBuffer.AppendBuf(mu8_PacketBuffer + 4, s32_Len) ||
-                !mi_CmacBuffer.AppendUint8(u8_CardStatus))
-                return -1;
-
-            if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
+            if (!mpk_Session->pi_SessionKey->CmacUpdate(mu8_PacketBuffer + 4, s32_Len) ||
+                !mpk_Session->pi_SessionKey->CmacUpdate(&u8_CardStatus, 1) ||
+                !mpk_Session->pi_SessionKey->CmacFinal(u8_CalcMac))
                 return -1;
 
             if (mu8_DebugLevel > 1)
             {
                 Utils::Print("RX CMAC:  ");
-                Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
+                Utils::PrintHexBuf(u8_CalcMac, mpk_Session->pi_SessionKey->GetBlockSize(), LF);
             }
       
             // For AES the CMAC is 16 byte, but only 8 are transmitted
@@ -1230,22 +2055,23 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
         return -1;
     } 
 
-    if (u8_RecvBuf && s32_Len)
+    // The response is decrypted in place. With u8_RecvBuf = NULL the caller reads it with GetResponseData().
+    byte* u8_Response = mu8_PacketBuffer + 4;
+    if ((e_Mac & MAC_Rcrypt) && s32_Len) // decrypt received data with session key
     {
-        memcpy(u8_RecvBuf, mu8_PacketBuffer + 4, s32_Len);
+        if (!mpk_Session->pi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Response, u8_Response, s32_Len))
+            return -1;
 
-        if (e_Mac & MAC_Rcrypt) // decrypt received data with session key
+        if (mu8_DebugLevel > 1)
         {
-            if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, u8_RecvBuf, s32_Len))
-                return -1;
+            Utils::Print("Decrypt:  ");
+            Utils::PrintHexBuf(u8_Response, s32_Len, LF);
+        }        
+    }    
+
+    if (u8_RecvBuf && s32_Len)
+        memcpy(u8_RecvBuf, u8_Response, s32_Len);
 
-            if (mu8_DebugLevel > 1)
-            {
-                Utils::Print("Decrypt:  ");
-                Utils::PrintHexBuf(u8_RecvBuf, s32_Len, LF);
-            }        
-        }    
-    }
     return s32_Len;
 }
 
@@ -1340,6 +2166,10 @@ bool Desfire::CheckCardStatus(DESFireStatus e_Status)
 // If any error occurres the test is aborted and the function returns false.
 bool Desfire::Selftest()
 {
+    // The CMAC is the base of all secured communication. It does not require a card.
+    if (!SelftestCmac())
+        return false;
+
     // Activate the RF field and start communication with the card
     byte u8_Length; // 4 or 7
     byte u8_UID[8];
@@ -1478,6 +2308,16 @@ bool Desfire::Selftest()
         !SelftestKeyChange(u32_AppAES,    &AES_DEFAULT_KEY, &i_AesKeyA,  &i_AesKeyB))
         return false;
 
+    // SelftestKeyChange() has set the application key #1 to key B
+    if (!SelftestFileModes(u32_App2KDES, &i_Des2KeyB) ||
+        !SelftestFileModes(u32_App3KDES, &i_Des3KeyB) ||
+        !SelftestFileModes(u32_AppAES,   &i_AesKeyB))
+        return false;
+
+    // The AES application is still selected and authenticated with key #1
+    if (!SelftestTransaction(&i_AesKeyB) || !SelftestRecordFiles())
+        return false;
+
     Utils::Print("--------------------------------------------------------------\r\n");
 
     const int FILE_LENGTH = 80; // this exceeds the frame size -> requires two frames for write / read    
@@ -1571,6 +2411,62 @@ bool Desfire::Selftest()
     return true;
 }
 
+// Checks DESFireKey::CmacUpdate() with the AES-CMAC test vectors of RFC 4493 (chapter 4).
+// Each message is fed in chunks of different sizes, so that blocks are split over several calls
+// and the last block is complete or must be padded.
+bool Desfire::SelftestCmac()
+{
+    const byte u8_Key[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+    const byte u8_Message[64] = 
+    { 
+        0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96, 0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A,
+        0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C, 0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51,
+        0x30, 0xC8, 0x1C, 0x46, 0xA3, 0x5C, 0xE4, 0x11, 0xE5, 0xFB, 0xC1, 0x19, 0x1A, 0x0A, 0x52, 0xEF,
+        0xF6, 0x9F, 0x24, 0x45, 0xDF, 0x4F, 0x9B, 0x17, 0xAD, 0x2B, 0x41, 0x7B, 0xE6, 0x6C, 0x37, 0x10,
+    };
+    const int  s32_Lengths[4] = { 0, 16, 40, 64 };
+    const byte u8_Expect[4][16] = 
+    {
+        { 0xBB, 0x1D, 0x69, 0x29, 0xE9, 0x59, 0x37, 0x28, 0x7F, 0xA3, 0x7D, 0x12, 0x9B, 0x75, 0x67, 0x46 },
+        { 0x07, 0x0A, 0x16, 0xB4, 0x6B, 0x4D, 0x41, 0x44, 0xF7, 0x9B, 0xDD, 0x9D, 0xD0, 0x4A, 0x28, 0x7C },
+        { 0xDF, 0xA6, 0x67, 0x47, 0xDE, 0x9A, 0xE6, 0x30, 0x30, 0xCA, 0x32, 0x61, 0x14, 0x97, 0xC8, 0x27 },
+        { 0x51, 0xF0, 0xBE, 0xBF, 0x7E, 0x3B, 0x9D, 0x92, 0xFC, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3C, 0xFE },
+    };
+    const int s32_Chunks[4] = { 1, 7, 16, 64 };
+
+    AES i_Key;
+    if (!i_Key.SetKeyData(u8_Key, 16, 0) || !i_Key.GenerateCmacSubkeys())
+        return false;
+
+    for (int M=0; M<4; M++)
+    {
+        for (int C=0; C<4; C++)
+        {
+            // RFC 4493 starts each message with a zero IV (Desfire chains the IV over the commands instead)
+            i_Key.ClearIV();
+            i_Key.CmacBegin();
+            for (int P=0; P<s32_Lengths[M]; P += s32_Chunks[C])
+            {
+                if (!i_Key.CmacUpdate(u8_Message + P, min(s32_Chunks[C], s32_Lengths[M] - P)))
+                    return false;
+            }
+
+            byte u8_Cmac[16];
+            if (!i_Key.CmacFinal(u8_Cmac))
+                return false;
+
+            if (memcmp(u8_Cmac, u8_Expect[M], 16) != 0)
+            {
+                char s8_Buf[80];
+                sprintf(s8_Buf, "CMAC failed (length= %d, chunk= %d)\r\n", s32_Lengths[M], s32_Chunks[C]);
+                Utils::Print(s8_Buf);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 // Changing the application key #0 is a completely different procedure from changing the key #1
 // So both must be tested thoroughly. 
 // If there should be any bug in ChangeKey() the consequence may be a card that you cannot authenticate anymore!
@@ -1675,3 +2571,328 @@ bool Desfire::SelftestKeyChange(uint32_t u32_Application, DESFireKey* pi_Default
     return true;
 }
 
+// CM_MAC and CM_ENCRYPT secure the file data with the session key, so they must be tested with all key types.
+// The file is longer than one frame, so the CMAC, the CRC32 and the encrypted blocks are split over several frames.
+// pi_Key is the application key #1. The application stays selected and authenticated with it.
+bool Desfire::SelftestFileModes(uint32_t u32_Application, DESFireKey* pi_Key)
+{
+    Utils::Print("--------------------------------------------------------------\r\n");
+
+    if (!SelectApplication(u32_Application))
+        return false;
+
+    if (!Authenticate(1, pi_Key))
+        return false;
+
+    const int FILE_LENGTH = 80; // this exceeds the frame size -> requires two frames for write / read
+
+    DESFireFilePermissions k_Permis;
+    k_Permis.e_ReadAccess         = AR_KEY1;
+    k_Permis.e_WriteAccess        = AR_KEY1;
+    k_Permis.e_ReadAndWriteAccess = AR_KEY1;
+    k_Permis.e_ChangeAccess       = AR_KEY0;
+
+    const DESFireFileEncryption e_Modes[] = { CM_PLAIN, CM_MAC, CM_ENCRYPT };
+    for (int M=0; M<3; M++)
+    {
+        if (!CreateStdDataFile(6, &k_Permis, FILE_LENGTH, e_Modes[M]))
+            return false;
+
+        byte u8_TxData[FILE_LENGTH];
+        for (int i=0; i<FILE_LENGTH; i++)
+        {
+            u8_TxData[i] = 0xA5 ^ (i * 3 + M);
+        }
+
+        if (!WriteFileData(6, 0, FILE_LENGTH, u8_TxData))
+            return false;
+
+        byte u8_RxData[FILE_LENGTH];
+        if (!ReadFileData(6, 0, FILE_LENGTH, u8_RxData))
+            return false;
+
+        if (memcmp(u8_TxData, u8_RxData, FILE_LENGTH) != 0)
+        {
+            char s8_Buf[80];
+            sprintf(s8_Buf, "Read/Write file failed (mode %d)\r\n", e_Modes[M]);
+            Utils::Print(s8_Buf);
+            return false;
+        }
+
+        if (!DeleteFile(6))
+            return false;
+    }
+    return true;
+}
+
+// Tests a Value File and a Backup Data File with DESFireTransaction, CommitTransaction() and AbortTransaction().
+// The last three transactions fail (too many changes, invalid value, debit below the lower limit) to check that ExecuteTransaction() discards all their changes.
+// The application must be selected and authenticated with the application key #1 (pi_Key).
+bool Desfire::SelftestTransaction(DESFireKey* pi_Key)
+{
+    Utils::Print("--------------------------------------------------------------\r\n");
+
+    const int FILE_LENGTH = 64; // the backup file with CMAC requires two frames for write
+
+    DESFireFilePermissions k_Permis;
+    k_Permis.e_ReadAccess         = AR_KEY1;
+    k_Permis.e_WriteAccess        = AR_KEY1;
+    k_Permis.e_ReadAndWriteAccess = AR_KEY1;
+    k_Permis.e_ChangeAccess       = AR_KEY0;
+
+    if (!CreateValueFile(7, &k_Permis, 0, 1000, 100, true, CM_ENCRYPT))
+        return false;
+
+    if (!CreateBackupDataFile(8, &k_Permis, FILE_LENGTH, CM_MAC))
+        return false;
+
+    byte u8_TxData[FILE_LENGTH];
+    for (int i=0; i<FILE_LENGTH; i++)
+    {
+        u8_TxData[i] = 0x5A ^ (i * 7);
+    }
+
+    // Credit 50, debit 20 and write the backup file with one commit -> 130
+    DESFireTransaction i_Trans;
+    i_Trans.Credit   (7, 50);
+    i_Trans.Debit    (7, 20);
+    i_Trans.WriteData(8, 0, FILE_LENGTH, u8_TxData);
+    if (!ExecuteTransaction(&i_Trans))
+        return false;
+
+    uint32_t u32_Value;
+    byte u8_RxData[FILE_LENGTH];
+    if (!ReadFileValue(7, &u32_Value) || !ReadFileData(8, 0, FILE_LENGTH, u8_RxData))
+        return false;
+
+    if (u32_Value != 130 || memcmp(u8_TxData, u8_RxData, FILE_LENGTH) != 0)
+    {
+        Utils::Print("ExecuteTransaction() failed\r\n");
+        return false;
+    }
+
+    // A debit of 30 allows a limited credit of 30 -> 100 -> 130
+    i_Trans.Clear();
+    i_Trans.Debit(7, 30);
+    if (!ExecuteTransaction(&i_Trans))
+        return false;
+
+    if (!LimitedCredit(7, 30) || !CommitTransaction())
+        return false;
+
+    if (!ReadFileValue(7, &u32_Value))
+        return false;
+
+    if (u32_Value != 130)
+    {
+        Utils::Print("LimitedCredit() failed\r\n");
+        return false;
+    }
+
+    // Discard a debit and a write of the backup file
+    byte u8_Zero[FILE_LENGTH] = {0};
+    if (!Debit(7, 30) || !WriteFileData(8, 0, FILE_LENGTH, u8_Zero) || !AbortTransaction())
+        return false;
+
+    if (!ReadFileValue(7, &u32_Value) || !ReadFileData(8, 0, FILE_LENGTH, u8_RxData))
+        return false;
+
+    if (u32_Value != 130 || memcmp(u8_TxData, u8_RxData, FILE_LENGTH) != 0)
+    {
+        Utils::Print("AbortTransaction() failed\r\n");
+        return false;
+    }
+
+    Utils::Print("Testing failing transactions (error messages are expected)\r\n");
+
+    // A transaction with one change more than allowed must be refused completely
+    i_Trans.Clear();
+    for (int i=0; i<=DF_MAX_TRANSACTION_STEPS; i++)
+    {
+        i_Trans.Credit(7, 1);
+    }
+    if (ExecuteTransaction(&i_Trans))
+    {
+        Utils::Print("ExecuteTransaction() did not fail\r\n");
+        return false;
+    }
+
+    if (!CommitTransaction() || !ReadFileValue(7, &u32_Value))
+        return false;
+
+    if (u32_Value != 130)
+    {
+        Utils::Print("ExecuteTransaction() did not refuse the full transaction\r\n");
+        return false;
+    }
+
+    // The invalid debit is rejected before it is sent -> ExecuteTransaction() must abort the credit and the write.
+    // The authentication stays valid, so a following commit would validate changes that were not aborted.
+    i_Trans.Clear();
+    i_Trans.Credit   (7, 10);
+    i_Trans.WriteData(8, 0, FILE_LENGTH, u8_Zero);
+    i_Trans.Debit    (7, -1);
+    if (ExecuteTransaction(&i_Trans))
+    {
+        Utils::Print("ExecuteTransaction() did not fail\r\n");
+        return false;
+    }
+
+    if (!CommitTransaction() || !ReadFileValue(7, &u32_Value) || !ReadFileData(8, 0, FILE_LENGTH, u8_RxData))
+        return false;
+
+    if (u32_Value != 130 || memcmp(u8_TxData, u8_RxData, FILE_LENGTH) != 0)
+    {
+        Utils::Print("ExecuteTransaction() did not abort\r\n");
+        return false;
+    }
+
+    // The card rejects the debit of 500 -> the credit of 10 must be discarded
+    i_Trans.Clear();
+    i_Trans.Credit(7, 10);
+    i_Trans.Debit (7, 500);
+    if (ExecuteTransaction(&i_Trans))
+    {
+        Utils::Print("ExecuteTransaction() did not fail\r\n");
+        return false;
+    }
+
+    // The error has invalidated the authentication
+    if (!Authenticate(1, pi_Key))
+        return false;
+
+    if (!ReadFileValue(7, &u32_Value))
+        return false;
+
+    if (u32_Value != 130)
+    {
+        Utils::Print("ExecuteTransaction() did not abort\r\n");
+        return false;
+    }
+
+    return DeleteFile(7) && DeleteFile(8);
+}
+
+// The content of the record number s32_Record in SelftestRecordFiles()
+static void SelftestRecord(byte* u8_Record, int s32_RecordSize, int s32_Record)
+{
+    for (int i=0; i<s32_RecordSize; i++)
+    {
+        u8_Record[i] = (s32_Record << 4) ^ i;
+    }
+}
+
+// Compares the records that ReadRecords() passes to the callback in SelftestReadRecords()
+struct kSelftestRecords
+{
+    int  s32_First;  // the number of the oldest record expected
+    int  s32_Count;  // the records received
+    bool b_Valid;
+};
+
+static void SelftestRecordCallback(void* p_Context, int s32_Index, const byte* u8_Record, int s32_RecordSize)
+{
+    kSelftestRecords* pk_Test = (kSelftestRecords*)p_Context;
+
+    byte u8_Expect[16];
+    SelftestRecord(u8_Expect, s32_RecordSize, pk_Test->s32_First + s32_Index);
+
+    if (s32_Index != pk_Test->s32_Count++ || memcmp(u8_Record, u8_Expect, s32_RecordSize) != 0)
+        pk_Test->b_Valid = false;
+}
+
+// Tests a Cyclic Record File (CM_ENCRYPT) and a Linear Record File (CM_MAC).
+// The records are read with one command that requires several frames, so records, encrypted blocks
+// and the CRC32 are split over frames. The application must be selected and authenticated with key #1.
+bool Desfire::SelftestRecordFiles()
+{
+    Utils::Print("--------------------------------------------------------------\r\n");
+
+    DESFireFilePermissions k_Permis;
+    k_Permis.e_ReadAccess         = AR_KEY1;
+    k_Permis.e_WriteAccess        = AR_KEY1;
+    k_Permis.e_ReadAndWriteAccess = AR_KEY1;
+    k_Permis.e_ChangeAccess       = AR_KEY0;
+
+    const int CYCLIC_SIZE  = 13; // 9 records -> the CRC is split over two frames, 6 records -> the CRC is split over two blocks
+    const int CYCLIC_COUNT = 10; // one record is reserved by the card -> keeps 9 records
+    const int LINEAR_SIZE  = 10;
+    const int LINEAR_COUNT = 8;
+
+    byte u8_Record[16];
+    DESFireFileSettings k_Settings;
+
+    // Write 11 records into the cyclic file -> the records 0 and 1 are overwritten.
+    // Each record is written in two parts.
+    if (!CreateCyclicRecordFile(9, &k_Permis, CYCLIC_SIZE, CYCLIC_COUNT, CM_ENCRYPT))
+        return false;
+
+    for (int R=0; R<11; R++)
+    {
+        SelftestRecord(u8_Record, CYCLIC_SIZE, R);
+        if (!WriteRecord(9, 0, 5, u8_Record) || !WriteRecord(9, 5, CYCLIC_SIZE - 5, u8_Record + 5) || !CommitTransaction())
+            return false;
+    }
+
+    if (!GetFileSettings(9, &k_Settings))
+        return false;
+
+    if (k_Settings.u32_CurrentNumberRecords != CYCLIC_COUNT - 1)
+    {
+        Utils::Print("Cyclic record file failed\r\n");
+        return false;
+    }
+
+    // all records (2...10) and the records 4...9
+    if (!SelftestReadRecords(9, 0, 9, CYCLIC_SIZE, 2, 9) ||
+        !SelftestReadRecords(9, 1, 6, CYCLIC_SIZE, 4, 6))
+        return false;
+
+    // Fill the linear file
+    if (!CreateLinearRecordFile(10, &k_Permis, LINEAR_SIZE, LINEAR_COUNT, CM_MAC))
+        return false;
+
+    for (int R=0; R<LINEAR_COUNT; R++)
+    {
+        SelftestRecord(u8_Record, LINEAR_SIZE, R);
+        if (!WriteRecord(10, 0, LINEAR_SIZE, u8_Record) || !CommitTransaction())
+            return false;
+    }
+
+    // all records (0...7) and the records 3...5
+    if (!SelftestReadRecords(10, 0, 0, LINEAR_SIZE, 0, LINEAR_COUNT) ||
+        !SelftestReadRecords(10, 2, 3, LINEAR_SIZE, 3, 3))
+        return false;
+
+    if (!ClearRecordFile(10) || !CommitTransaction() || !GetFileSettings(10, &k_Settings))
+        return false;
+
+    if (k_Settings.u32_CurrentNumberRecords != 0)
+    {
+        Utils::Print("ClearRecordFile() failed\r\n");
+        return false;
+    }
+
+    return DeleteFile(9) && DeleteFile(10);
+}
+
+// Reads s32_Count records with ReadRecords() and compares them with the records s32_First, s32_First + 1,...
+// s32_Expect is the count of records that the card must return.
+bool Desfire::SelftestReadRecords(byte u8_FileID, int s32_Offset, int s32_Count, int s32_RecordSize, int s32_First, int s32_Expect)
+{
+    kSelftestRecords k_Test;
+    k_Test.s32_First = s32_First;
+    k_Test.s32_Count = 0;
+    k_Test.b_Valid   = true;
+
+    byte u8_Record[16];
+    if (!ReadRecords(u8_FileID, s32_Offset, s32_Count, u8_Record, s32_RecordSize, SelftestRecordCallback, &k_Test))
+        return false;
+
+    if (!k_Test.b_Valid || k_Test.s32_Count != s32_Expect)
+    {
+        Utils::Print("ReadRecords() failed\r\n");
+        return false;
+    }
+    return true;
+}
@@ -10,7 +10,18 @@
 // Just an invalid key number
 #define NOT_AUTHENTICATED      255
 
-#define MAX_FRAME_SIZE         60 // The maximum total length of a packet that is transfered to / from the card
+// The maximum total length of a packet that is transfered to / from the card if the card did not send an ATS.
+// Otherwise the frame size is calculated from the FSC in the ATS (see GetFrameSize()): Desfire EV1: FSC = 64 -> 60 bytes.
+#define MAX_FRAME_SIZE         60
+
+// The maximum payload that fits into one DataExchange() with CMAC (PN532 frame + INDATAEXCHANGE header + status + CMAC)
+#define MAX_EXCHANGE_SIZE      (PN532_PACKBUFFSIZE - PN532_FRAME_OVERHEAD - 4 - 8)
+
+// The ISO14443-4 block overhead that the FSC includes: PCB + CID + CRC16
+#define DF_BLOCK_OVERHEAD      4
+
+// The time in milliseconds that is added to the frame waiting time of the card for the PN532 and the host (see GetExchangeTimeout())
+#define DF_FWT_MARGIN          20
 
 // ------- Desfire legacy instructions --------
 
@@ -203,17 +214,20 @@ struct DESFireFilePermissions
 enum DESFireFileEncryption
 {
     CM_PLAIN   = 0x00,
-    CM_MAC     = 0x01,   // not implemented (Plain data transfer with additional MAC)
-    CM_ENCRYPT = 0x03,   // not implemented (Does not make data stored on the card more secure. Only encrypts the transfer between Teensy and the card)
+    CM_MAC     = 0x01,   // Plain data transfer with additional MAC
+    CM_ENCRYPT = 0x03,   // Does not make data stored on the card more secure. Only encrypts the transfer between Teensy and the card
 };
 
+// Desfire EV1: maximum = 32 files per application (file ID 0...31)
+#define DF_MAX_FILES           32
+
 enum DESFireFileType
 {
     MDFT_STANDARD_DATA_FILE             = 0x00,
-    MDFT_BACKUP_DATA_FILE               = 0x01, // not implemented
-    MDFT_VALUE_FILE_WITH_BACKUP         = 0x02, // not implemented
-    MDFT_LINEAR_RECORD_FILE_WITH_BACKUP = 0x03, // not implemented
-    MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP = 0x04, // not implemented
+    MDFT_BACKUP_DATA_FILE               = 0x01,
+    MDFT_VALUE_FILE_WITH_BACKUP         = 0x02,
+    MDFT_LINEAR_RECORD_FILE_WITH_BACKUP = 0x03,
+    MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP = 0x04,
 };
 
 struct DESFireFileSettings
@@ -246,16 +260,157 @@ enum DESFireCmac
     // Receive data:
     MAC_Rmac   = 4, // The CMAC must be calculated for the RX data received from the card. If status == ST_Success -> verify the CMAC in the response
     MAC_Rcrypt = 8, // The data received from the card must be decrypted with the session key
+    MAC_Rchain = 16, // The RX CMAC continues over the frames received before (ST_MoreFrames), otherwise a new RX CMAC begins
     // Combined:
     MAC_TmacRmac   = MAC_Tmac   | MAC_Rmac,
+    MAC_RmacRchain = MAC_Rmac   | MAC_Rchain,
     MAC_TmacRcrypt = MAC_Tmac   | MAC_Rcrypt,
     MAC_TcryptRmac = MAC_Tcrypt | MAC_Rmac,
 };
 
+// The changes that DESFireTransaction collects
+enum DESFireTxOperation
+{
+    TXOP_Credit,
+    TXOP_Debit,
+    TXOP_LimitedCredit,
+    TXOP_WriteData,   // WriteFileData() to a Backup Data File
+    TXOP_WriteRecord, // WriteRecord() to a Linear or Cyclic Record File
+};
+
+// One change in DESFireTransaction
+struct kDesfireTxStep
+{
+    DESFireTxOperation e_Operation;
+    byte        u8_FileID;
+    int         s32_Value;   // Credit, Debit, LimitedCredit: the amount, WriteData, WriteRecord: the offset
+    int         s32_Length;  // WriteData, WriteRecord: the count of bytes
+    const byte* u8_Data;     // WriteData, WriteRecord: the data (must stay valid until ExecuteTransaction() returns)
+};
+
+// The maximum count of changes in one DESFireTransaction
+#define DF_MAX_TRANSACTION_STEPS   8
+
+// Collects several changes of Value Files, Backup Data Files and Record Files in the selected application.
+// Desfire::ExecuteTransaction() sends them and commits them all at once with one CommitTransaction.
+// Either all changes become valid or none of them.
+class DESFireTransaction
+{
+public:
+    DESFireTransaction() 
+    { 
+        Clear(); 
+    }
+    inline void Clear() 
+    { 
+        ms32_Count  = 0; 
+        mb_Overflow = false;
+    }
+    bool Credit       (byte u8_FileID, int s32_Value) { return Add(TXOP_Credit,        u8_FileID, s32_Value, 0, NULL); }
+    bool Debit        (byte u8_FileID, int s32_Value) { return Add(TXOP_Debit,         u8_FileID, s32_Value, 0, NULL); }
+    bool LimitedCredit(byte u8_FileID, int s32_Value) { return Add(TXOP_LimitedCredit, u8_FileID, s32_Value, 0, NULL); }
+    bool WriteData    (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_Data) 
+    { 
+        return Add(TXOP_WriteData, u8_FileID, s32_Offset, s32_Length, u8_Data); 
+    }
+    bool WriteRecord  (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_Data) 
+    { 
+        return Add(TXOP_WriteRecord, u8_FileID, s32_Offset, s32_Length, u8_Data); 
+    }
+    inline int GetCount() 
+    { 
+        return ms32_Count; 
+    }
+    inline const kDesfireTxStep* GetStep(int s32_Index) 
+    { 
+        return &mk_Steps[s32_Index]; 
+    }
+    // true if a change could not be added -> Desfire::ExecuteTransaction() refuses the transaction
+    inline bool IsOverflow() 
+    { 
+        return mb_Overflow; 
+    }
+
+private:
+    bool Add(DESFireTxOperation e_Operation, byte u8_FileID, int s32_Value, int s32_Length, const byte* u8_Data)
+    {
+        if (ms32_Count >= DF_MAX_TRANSACTION_STEPS)
+        {
+            Utils::Print("Transaction is full\r\n");
+            mb_Overflow = true;
+            return false;
+        }
+        kDesfireTxStep* pk_Step = &mk_Steps[ms32_Count++];
+        pk_Step->e_Operation = e_Operation;
+        pk_Step->u8_FileID   = u8_FileID;
+        pk_Step->s32_Value   = s32_Value;
+        pk_Step->s32_Length  = s32_Length;
+        pk_Step->u8_Data     = u8_Data;
+        return true;
+    }
+
+    kDesfireTxStep mk_Steps[DF_MAX_TRANSACTION_STEPS];
+    int            ms32_Count;
+    bool           mb_Overflow;
+};
+
+// Receives the records from ReadRecords() one by one while the frames arrive from the card.
+// s32_Index counts the records passed in this call of ReadRecords() (the oldest record first).
+typedef void (*DESFireRecordCallback)(void* p_Context, int s32_Index, const byte* u8_Record, int s32_RecordSize);
+
+// Assembles the records for DESFireRecordCallback from the frames (a record may be split over two frames)
+struct kDesfireRecordSink
+{
+    DESFireRecordCallback f_Callback;
+    void* p_Context;
+    byte* u8_Record;      // the buffer of the caller for one record
+    int   s32_RecordSize;
+    int   s32_Fill;       // the bytes in u8_Record
+    int   s32_Index;      // the count of records passed to f_Callback
+};
+
+// The deadlines of the host for the response of the card to DataExchange() depend on the command (see SetExchangeTimeout())
+// A card that has left the field is detected after the short timeout of a read command instead of PN532_TIMEOUT.
+enum DESFireTimeout
+{
+    DF_TMO_Read   = 0, // commands that do not write to the EEPROM (GetKeyVersion, GetVersion, SelectApplication, ReadData,...)
+    DF_TMO_Auth   = 1, // authentication (the card must calculate the cryptogram)
+    DF_TMO_Write  = 2, // commands that write to the EEPROM (ChangeKey, CreateApplication, WriteData, CommitTransaction,...)
+    DF_TMO_Format = 3, // FormatCard (erases the entire card)
+    DF_TMO_Count
+};
+
+// The default deadlines in milliseconds
+// They must be longer than the RF timeout of the PN532 multiplied with the retries (see PN532::SetRfTimeouts())
+#define DF_TIMEOUT_READ     250
+#define DF_TIMEOUT_AUTH     250
+#define DF_TIMEOUT_WRITE    PN532_TIMEOUT
+#define DF_TIMEOUT_FORMAT   5000
+
+// Remembers the parameters of a DataExchange() between StartDataExchange() and FinishDataExchange()
+struct kDesfireExchange
+{
+    byte*          u8_RecvBuf;
+    int           s32_RecvSize;
+    DESFireStatus* pe_Status;
+    DESFireCmac    e_Mac;
+};
+
+// The state of the communication with one card (see SetTarget())
+struct kDesfireSession
+{
+    byte          u8_LastAuthKeyNo; // The last key which did a successful authetication (0xFF if not yet authenticated)
+    uint32_t     u32_LastApplication;
+    DESFireKey*   pi_SessionKey;    // points to i_AesSessionKey or i_DesSessionKey
+    byte          u8_FileModes[DF_MAX_FILES]; // communication mode for reading (bits 0-3) and writing (bits 4-7) or 0xFF if unknown (see GetFileMode())
+    AES           i_AesSessionKey;
+    DES           i_DesSessionKey;
+};
+
 class Desfire : public PN532
 {
  public:
-    Desfire();
+    Desfire(PN532Transport* pi_Transport, byte u8_Reset);
     bool GetCardVersion(DESFireCardVersion* pk_Version);
     bool FormatCard();
     bool EnableRandomIDForever();
@@ -277,12 +432,29 @@ class Desfire : public PN532
     bool GetFileIDs       (byte* u8_FileIDs, byte* pu8_FileCount);
     bool GetFileSettings  (byte u8_FileID, DESFireFileSettings* pk_Settings);
     bool DeleteFile       (byte u8_FileID);
-    bool CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize);
+    bool SetFileMode      (byte u8_FileID, DESFireFileEncryption e_Read, DESFireFileEncryption e_Write);
+    bool CreateStdDataFile   (byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool CreateBackupDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool CreateValueFile     (byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_LowerLimit, int s32_UpperLimit, int s32_Value, bool b_LimitedCredit, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool CreateLinearRecordFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_RecordSize, int s32_MaxRecords, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool CreateCyclicRecordFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_RecordSize, int s32_MaxRecords, DESFireFileEncryption e_Encrypt = CM_PLAIN);
     bool ReadFileData     (byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer);
     bool WriteFileData    (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer);
-	bool ReadFileValue    (byte u8_FileID, uint32_t* pu32_Value);
+    bool ReadFileValue    (byte u8_FileID, uint32_t* pu32_Value);
+    bool Credit           (byte u8_FileID, int s32_Value);
+    bool Debit            (byte u8_FileID, int s32_Value);
+    bool LimitedCredit    (byte u8_FileID, int s32_Value);
+    bool WriteRecord      (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer);
+    bool ReadRecords      (byte u8_FileID, int s32_Offset, int s32_Count, byte* u8_RecordBuf, int s32_RecordSize, DESFireRecordCallback f_Callback, void* p_Context);
+    bool ClearRecordFile  (byte u8_FileID);
+    bool CommitTransaction();
+    bool AbortTransaction();
+    bool ExecuteTransaction(DESFireTransaction* pi_Transaction);
     // ---------------------
     bool SwitchOffRfField();  // overrides PN532::SwitchOffRfField()
+    bool EnterPowerDown(byte u8_WakeSources = 0); // overrides PN532::EnterPowerDown()
+    bool SetTarget(byte u8_Tg); // overrides PN532::SetTarget()
+    void SetExchangeTimeout(DESFireTimeout e_Class, uint32_t u32_Timeout);
     bool Selftest();
     byte GetLastPN532Error(); // See comment for this function in CPP file
 
@@ -290,22 +462,44 @@ class Desfire : public PN532
     DES  DES3_DEFAULT_KEY; // 3K3DES key with 24 zeroes 
     AES   AES_DEFAULT_KEY; // AES    key with 16 zeroes
 
+ protected:
+    // Resumable (non-blocking) version of DataExchange()
+    bool StartDataExchange(TxBuffer* pi_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
+    int  FinishDataExchange();
+    byte RfTrial(); // overrides PN532::RfTrial()
+    // The (decrypted) data of the last response inside the packet buffer, valid until the next command
+    inline const byte* GetResponseData() { return mu8_PacketBuffer + 4; }
+
  private:
     int  DataExchange(byte      u8_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
     int  DataExchange(TxBuffer* pi_Command, TxBuffer* pi_Params, byte* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);    
     bool CheckCardStatus(DESFireStatus e_Status);
     bool SelftestKeyChange(uint32_t u32_Application, DESFireKey* pi_DefaultKey, DESFireKey* pi_NewKeyA, DESFireKey* pi_NewKeyB);
-
-    byte          mu8_LastAuthKeyNo; // The last key which did a successful authetication (0xFF if not yet authenticated)
-    uint32_t      mu32_LastApplication;
-    DESFireKey*   mpi_SessionKey;
-    AES           mi_AesSessionKey;
-    DES           mi_DesSessionKey;
+    bool SelftestCmac();
+    bool SelftestFileModes(uint32_t u32_Application, DESFireKey* pi_Key);
+    bool SelftestTransaction(DESFireKey* pi_Key);
+    bool SelftestRecordFiles();
+    bool SelftestReadRecords(byte u8_FileID, int s32_Offset, int s32_Count, int s32_RecordSize, int s32_First, int s32_Expect);
+
+    void ResetSessions();
+    DESFireTimeout GetTimeoutClass(byte u8_Command);
+    uint32_t GetExchangeTimeout(DESFireTimeout e_Class);
+    int  GetFrameSize();
+    void ForgetFileModes(int s32_FileID = -1);
+    bool GetFileMode(byte u8_FileID, bool b_Write, DESFireFileEncryption* pe_Mode);
+    bool SendFileData(byte u8_Command, TxBuffer* pi_Header, const byte* u8_Data, int s32_Length, DESFireFileEncryption e_Mode);
+    bool ReceiveEncrypted(byte u8_Command, TxBuffer* pi_Params, byte* u8_Data, int s32_Length, kDesfireRecordSink* pk_Sink = NULL);
+    void PutRecordData(kDesfireRecordSink* pk_Sink, const byte* u8_Data, int s32_Length);
+    bool CreateRecordFile(byte u8_Command, byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_RecordSize, int s32_MaxRecords, DESFireFileEncryption e_Encrypt);
+    bool CreateDataFile(byte u8_Command, byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize, DESFireFileEncryption e_Encrypt);
+    bool ChangeValue(byte u8_Command, byte u8_FileID, int s32_Value);
+
+    kDesfireSession  mk_Sessions[PN532_MAX_TARGETS]; // one session for each card (see SetTarget())
+    kDesfireSession* mpk_Session;                     // the session of the current target
     byte          mu8_LastPN532Error;
-
-    // Must have enough space to hold the entire response from DF_INS_GET_APPLICATION_IDS (84 byte) + CMAC padding
-    byte          mu8_CmacBuffer_Data[120]; 
-    TxBuffer      mi_CmacBuffer;
+    uint32_t      mu32_Timeouts[DF_TMO_Count]; // the deadlines of the host in milliseconds (see SetExchangeTimeout())
+    DESFireTimeout me_LastTimeout;             // the class of the last command (used for DF_INS_ADDITIONAL_FRAME)
+    kDesfireExchange mk_Exchange;
 };
 
 #endif
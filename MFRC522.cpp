@@ -135,7 +135,7 @@ void MFRC522::begin()
     }
     #elif USE_HARDWARE_I2C
     {
-        I2cClass::Begin();
+        I2cClass::Begin(MFRC522_I2C_CLOCK);
     }
     #endif
 }
@@ -636,6 +636,10 @@ bool MFRC522::IsReady()
         
         return u8_Ready == MFRC522_I2C_READY; // 0x01
     }
+    #else
+    {
+        return false; // HSU mode is only implemented for the PN532
+    }
     #endif
 }
 
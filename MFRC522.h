@@ -79,6 +79,7 @@
 
 #define MFRC522_I2C_ADDRESS                   (0x48 >> 1)
 #define MFRC522_I2C_READY                     (0x01)
+#define MFRC522_I2C_CLOCK                     (100000) // Standard mode
 
 #define MFRC522_GPIO_P30                      (0x01)
 #define MFRC522_GPIO_P31                      (0x02)
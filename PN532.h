@@ -2,29 +2,86 @@
 #ifndef ADAFRUIT_PN532_H
 #define ADAFRUIT_PN532_H
 
-#include "Utils.h"
+#include "Transport.h"
 
 // ----------------------------------------------------------------------
 
-// This parameter may be used to slow down the software SPI bus speed.
-// This is required when there is a long cable between the PN532 and the Teensy.
-// This delay in microseconds (not milliseconds!) is made between toggeling the CLK line.
-// Use an oscilloscope to check the resulting speed!
-// A value of 50 microseconds results in a clock signal of 10 kHz
-// A value of 0 results in maximum speed (depends on CPU speed).
-// This parameter is not used for hardware SPI mode.
-#define PN532_SOFT_SPI_DELAY  50
-
-// The clock (in Hertz) when using Hardware SPI mode
-// This parameter is not used for software SPI mode.
-#define PN532_HARD_SPI_CLOCK  1000000
-
 // The maximum time to wait for an answer from the PN532
 // Do NOT use infinite timeouts like in Adafruit code!
 #define PN532_TIMEOUT  1000
 
-// The packet buffer is used for sending commands and for receiving responses from the PN532
-#define PN532_PACKBUFFSIZE   80
+// WaitReady() polls the PN532 first after PN532_POLL_MIN microseconds.
+// After each poll the interval is doubled up to PN532_POLL_MAX microseconds.
+// This is not used when the IRQ pin is connected. (See SetIrqPin())
+#define PN532_POLL_MIN  50
+#define PN532_POLL_MAX  2000
+
+// Pass this to SetIrqPin() if the IRQ pin of the PN532 is not connected
+#define PN532_NO_IRQ    0xFF
+
+// The slow timing that was used before the timing became configurable.
+// CalibrateTiming() starts here and then makes each delay shorter as long as the communication is error free.
+#define PN532_SAFE_CS_SETUP         2000
+#define PN532_SAFE_INTER_BYTE       1000
+#define PN532_SAFE_CS_RELEASE       50
+#define PN532_SAFE_HALF_PERIOD      50 // software SPI clock: 10 kHz
+
+// The count of retries for the activation of a card (see SetPassiveActivationRetries())
+// One retry is enough for Mifare Classic but Desfire is slower (if you modify this, you must also modify PN532_TIMEOUT!)
+// A lower value makes a shorter RF pulse for each search of ReadPassiveTargetID().
+#define PN532_ACTIVATION_RETRIES    3
+
+// The timeouts of the PN532 for the communication with the card (see SetRfTimeouts(), chapter 7.3.1)
+// The timeout is 100 microseconds * 2 ^ (value - 1)
+#define PN532_RFTIMEOUT_NONE        0x00 // no timeout
+#define PN532_RFTIMEOUT_100US       0x01
+#define PN532_RFTIMEOUT_200US       0x02
+#define PN532_RFTIMEOUT_400US       0x03
+#define PN532_RFTIMEOUT_800US       0x04
+#define PN532_RFTIMEOUT_1MS6        0x05
+#define PN532_RFTIMEOUT_3MS2        0x06
+#define PN532_RFTIMEOUT_6MS4        0x07
+#define PN532_RFTIMEOUT_12MS8       0x08
+#define PN532_RFTIMEOUT_25MS6       0x09
+#define PN532_RFTIMEOUT_51MS2       0x0A // default of fRetryTimeout
+#define PN532_RFTIMEOUT_102MS4      0x0B // default of fATR_RES_Timeout
+#define PN532_RFTIMEOUT_204MS8      0x0C
+#define PN532_RFTIMEOUT_409MS6      0x0D
+#define PN532_RFTIMEOUT_819MS2      0x0E
+#define PN532_RFTIMEOUT_1S64        0x0F
+#define PN532_RFTIMEOUT_3S28        0x10
+
+// The count of GetFirmwareVersion + Diagnose echo round trips that must succeed for each timing step in CalibrateTiming()
+#define PN532_CALIBRATION_TRIALS    5
+
+// The count of data bytes that the PN532 echoes back in each calibration trial (Diagnose communication line test)
+#define PN532_ECHO_LENGTH           32
+
+// After this count of invalid responses in a row ReadData() doubles all delays of a calibrated timing (see CalibrateTiming())
+#define PN532_LINK_ERRORS           3
+
+// The packet buffer is used for sending commands and for receiving responses from the PN532.
+// It limits the size of one data exchange with the card. A normal frame transports up to 254 data bytes.
+// If you define a bigger buffer (e.g. with -DPN532_PACKBUFFSIZE=280) extended frames are used (chapter 6.2.1.3)
+// which transport up to 262 bytes (the maximum of InDataExchange). Each byte costs RAM only once (member).
+// With I2C a frame cannot be longer than PN532_I2C_MAX_READ bytes (see Transport.h).
+#ifndef PN532_PACKBUFFSIZE
+    #define PN532_PACKBUFFSIZE   80
+#endif
+
+// The count of bytes that a frame adds around the data (preamble, start codes, length, checksums, postamble)
+// LEN also counts the TFI byte (D4), so a command of 255 bytes already requires an extended frame.
+#if PN532_PACKBUFFSIZE >= 255
+    #define PN532_FRAME_OVERHEAD  10 // extended frame: 00 00 FF FF FF LENM LENL LCS ... DCS 00
+    #define PN532_FRAME_HEADROOM   9 // 00 00 FF FF FF LENM LENL LCS D4
+#else
+    #define PN532_FRAME_OVERHEAD   7 // normal frame:   00 00 FF LEN LCS ... DCS 00
+    #define PN532_FRAME_HEADROOM   6 // 00 00 FF LEN LCS D4
+#endif
+
+// The packet buffer is embedded into the frame buffer with room for the frame header in front and DCS + postamble behind.
+// WriteCommand() builds the frame around the packet and ReadData() parses the response without any temporary buffer.
+#define PN532_FRAME_TAILROOM       2 // DCS 00
 
 // ----------------------------------------------------------------------
 
@@ -70,16 +127,6 @@
 #define PN532_COMMAND_TGRESPONSETOINITIATOR (0x90)
 #define PN532_COMMAND_TGGETTARGETSTATUS     (0x8A)
 
-#define PN532_WAKEUP                        (0x55)
-
-#define PN532_SPI_STATUSREAD                (0x02)
-#define PN532_SPI_DATAWRITE                 (0x01)
-#define PN532_SPI_DATAREAD                  (0x03)
-#define PN532_SPI_READY                     (0x01)
-
-#define PN532_I2C_ADDRESS                   (0x48 >> 1)
-#define PN532_I2C_READY                     (0x01)
-
 #define PN532_GPIO_P30                      (0x01)
 #define PN532_GPIO_P31                      (0x02)
 #define PN532_GPIO_P32                      (0x04)
@@ -94,6 +141,68 @@
 #define CARD_TYPE_106KB_ISO14443B           (0x03) // card baudrate 106 kB
 #define CARD_TYPE_106KB_JEWEL               (0x04) // card baudrate 106 kB
 
+// The PN532 can handle max 2 cards at the same time (chapter 7.3.5)
+#define PN532_MAX_TARGETS                   2
+// The maximum count of ATS bytes that are stored in kPN532Target (a Desfire card sends 6 bytes)
+#define PN532_MAX_ATS                       20
+// The maximum count of historical bytes that are stored in kPN532Ats (a Desfire card sends 1 byte)
+#define PN532_MAX_HISTORICAL                8
+
+// Bit rates between PN532 and card for InPSL (chapter 7.3.4)
+#define PN532_BITRATE_106KB                 (0x00)
+#define PN532_BITRATE_212KB                 (0x01)
+#define PN532_BITRATE_424KB                 (0x02)
+#define PN532_BITRATE_848KB                 (0x03)
+
+// The fastest bit rate that UpgradeBitrate() negotiates with an ISO14443-4 card (Desfire).
+// The PN532 datasheet specifies ISO14443A up to 424 kB. 848 kB works with many cards, but depends on the antenna.
+#ifndef PN532_MAX_BITRATE
+    #define PN532_MAX_BITRATE   PN532_BITRATE_424KB
+#endif
+
+// The CIU registers that define the analog RF settings (see ReadRegisters(), PN532 datasheet chapter 8.6.23)
+#define PN532_REG_CIU_RXTHRESHOLD           (0x6308) // minimum signal strength and collision level of the decoder
+#define PN532_REG_CIU_DEMOD                 (0x6309) // demodulator settings
+#define PN532_REG_CIU_RFCFG                 (0x6316) // bits 4-6: receiver gain, bits 0-3: RF level detector
+#define PN532_REG_CIU_GSNON                 (0x6317) // conductance of the N-driver: bits 4-7 carrier, bits 0-3 modulation
+#define PN532_REG_CIU_CWGSP                 (0x6318) // conductance of the P-driver during the carrier (bits 0-5)
+#define PN532_REG_CIU_MODGSP                (0x6319) // conductance of the P-driver during modulation (bits 0-5)
+
+// The receiver gain in CIU_RFCfg (bits 4-6)
+#define PN532_RXGAIN_18DB                   (0x00)
+#define PN532_RXGAIN_23DB                   (0x10)
+#define PN532_RXGAIN_33DB                   (0x40)
+#define PN532_RXGAIN_38DB                   (0x50)
+#define PN532_RXGAIN_43DB                   (0x60)
+#define PN532_RXGAIN_48DB                   (0x70)
+#define PN532_RXGAIN_MASK                   (0x70)
+
+// The maximum count of registers that ReadRegisters() / WriteRegisters() transfer in one command
+#define PN532_MAX_REGISTERS                 ((PN532_PACKBUFFSIZE - 1) / 3)
+
+// The count of trials per setting in TuneRf()
+#define PN532_TUNING_TRIALS                 10
+
+// Target types for StartAutoPoll() (chapter 7.3.13)
+// Only the 106 kB ISO14443A types return a card UID, all other types are reported as unsupported card.
+#define AUTOPOLL_TYPE_106KB_GENERIC         (0x00) // Generic passive 106 kB (ISO14443-4A, Mifare and DEP)
+#define AUTOPOLL_TYPE_212KB_GENERIC         (0x01) // Generic passive 212 kB (FeliCa and DEP)
+#define AUTOPOLL_TYPE_424KB_GENERIC         (0x02) // Generic passive 424 kB (FeliCa and DEP)
+#define AUTOPOLL_TYPE_106KB_ISO14443B       (0x03) // Passive 106 kB ISO14443-4B
+#define AUTOPOLL_TYPE_106KB_JEWEL           (0x04) // Innovision Jewel tag
+#define AUTOPOLL_TYPE_MIFARE                (0x10) // Mifare card
+#define AUTOPOLL_TYPE_212KB_FELICA          (0x11) // FeliCa 212 kB card
+#define AUTOPOLL_TYPE_424KB_FELICA          (0x12) // FeliCa 424 kB card
+#define AUTOPOLL_TYPE_106KB_ISO14443_4A     (0x20) // Passive 106 kB ISO14443-4A (Desfire)
+#define AUTOPOLL_TYPE_106KB_ISO14443_4B     (0x23) // Passive 106 kB ISO14443-4B
+
+// Pass this as poll count to StartAutoPoll() to search until a card is found or StopAutoPoll() is called
+#define AUTOPOLL_ENDLESS                    (0xFF)
+// The unit of the period passed to StartAutoPoll() in milliseconds
+#define AUTOPOLL_PERIOD_UNIT                150
+// The PN532 accepts max 15 target types in one InAutoPoll command
+#define AUTOPOLL_MAX_TYPES                  15
+
 // Prefixes for NDEF Records (to identify record type), not used
 #define NDEF_URIPREFIX_NONE                 (0x00)
 #define NDEF_URIPREFIX_HTTP_WWWDOT          (0x01)
@@ -139,61 +248,177 @@ enum eCardType
     CARD_DesRandom = 3, // A Desfire card with 4 byte random UID  (bit 0 + 1)
 };
 
+// The capabilities of an ISO14443-4 card from its ATS (ISO14443-4 chapter 5.2, see ParseAts())
+// Cards without ATS (e.g. Mifare Classic) have u16_FSC = 0.
+struct kPN532Ats
+{
+    uint16_t u16_FSC;       // the maximum frame size that the card accepts (FSCI), including PCB, CID and CRC
+    uint32_t u32_FWT;       // the frame waiting time in microseconds (FWI): the card answers or requests more time (WTX) within this time
+    uint32_t u32_SFGT;      // the time in microseconds that the card needs after the ATS before it accepts the next frame (SFGI)
+    byte      u8_TA1;       // the supported bit rates (see UpgradeBitrate())
+    bool      b_CID;        // the card supports the card identifier
+    bool      b_NAD;        // the card supports the node address
+    byte      u8_Historical[PN532_MAX_HISTORICAL];
+    byte      u8_HistLength;
+};
+
+// One ISO14443A card returned by ReadPassiveTargets()
+struct kPN532Target
+{
+    byte      u8_Tg;                  // the logical target number (1 or 2) that must be passed to SetTarget()
+    byte      u8_Uid[10];             // the UID (4, 7 or 10 bytes)
+    byte      u8_UidLength;
+    uint16_t u16_ATQA;                // SENS_RES
+    byte      u8_SAK;                 // SEL_RES
+    byte      u8_Ats[PN532_MAX_ATS];  // the ATS (ISO14443-4 cards only) starting with the length byte TL
+    byte      u8_AtsLength;           // 0 if the card did not send an ATS
+    kPN532Ats k_Ats;                  // the parsed ATS
+    eCardType e_CardType;
+};
+
+// The analog settings for ISO14443A at 106 kB that SetRfSetting() loads and TuneRf() tries.
+// The PN532 defaults are: CIU_RFCfg = 0x59, CIU_GsNOn = 0xF4, CIU_CWGsP = 0x3F, CIU_ModGsP = 0x11
+struct kPN532RfSetting
+{
+    byte      u8_RFCfg;     // CIU_RFCfg:  receiver gain (PN532_RXGAIN_XXX) + RF level detector
+    byte      u8_GsNOn;     // CIU_GsNOn:  conductance of the N-driver
+    byte      u8_CWGsP;     // CIU_CWGsP:  conductance of the P-driver during the carrier
+    byte      u8_ModGsP;    // CIU_ModGsP: conductance of the P-driver during modulation
+    // The results of TuneRf()
+    uint16_t u16_Trials;
+    uint16_t u16_Timeouts;  // the trials that failed because the card did not answer (PN532 error 0x01)
+    uint16_t u16_Errors;    // the trials that failed with any other error
+};
+
+// The state of the command engine (see StartCommand())
+enum ePN532Job
+{
+    JOB_Idle  = 0, // No command has been started
+    JOB_Busy  = 1, // Waiting for the ACK or the response of the PN532
+    JOB_Done  = 2, // The response has been received -> call FinishCommand()
+    JOB_Error = 3, // Timeout or invalid response    -> call FinishCommand()
+};
+
 class PN532
 {
  public:
-    PN532();
-    
-    #if USE_SOFTWARE_SPI
-        void InitSoftwareSPI(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, byte u8_Reset);
-    #endif
-    #if USE_HARDWARE_SPI
-        void InitHardwareSPI(byte u8_Sel, byte u8_Reset);    
-    #endif
-    #if USE_HARDWARE_I2C
-        void InitI2C        (byte u8_Reset);
-    #endif
+    PN532(PN532Transport* pi_Transport, byte u8_Reset);
     
     // Generic PN532 functions
     void begin();  
     void SetDebugLevel(byte level);
+    void SetIrqPin(byte u8_Irq);
+    void SetTiming(const kPN532Timing* pk_Timing);
+    void GetTiming(kPN532Timing* pk_Timing);
+    bool CalibrateTiming(byte u8_Trials = PN532_CALIBRATION_TRIALS);
     bool SamConfig();
     bool GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo, byte* pFlags);
     bool WriteGPIO(bool P30, bool P31, bool P33, bool P35);
-    bool SetPassiveActivationRetries();
+    bool SetPassiveActivationRetries(byte u8_Retries = PN532_ACTIVATION_RETRIES);
+    bool SetMaxRetries(byte u8_MxRtyATR, byte u8_MxRtyPSL, byte u8_MxRtyPassive);
+    bool SetCommunicationRetries(byte u8_MaxRtyCOM);
+    bool SetRfTimeouts(byte u8_AtrTimeout, byte u8_RetryTimeout);
+    bool ReadRegisters (const uint16_t* pu16_Addr, byte* pu8_Values, byte u8_Count);
+    bool WriteRegisters(const uint16_t* pu16_Addr, const byte* pu8_Values, byte u8_Count);
+    bool SetRfSetting(const kPN532RfSetting* pk_Setting);
+    int  TuneRf(kPN532RfSetting* pk_Settings, byte u8_Count, byte u8_Trials = PN532_TUNING_TRIALS);
+    bool SetSerialBaudRate(uint32_t u32_Baud);
     bool DeselectCard();
     bool ReleaseCard();
     bool SelectCard();
+    bool UpgradeBitrate();
+    bool IsCardPresent();
+    const kPN532Ats* GetCardAts();
 
-    // This function is overridden in Desfire.cpp
+    // These functions are overridden in Desfire.cpp
     virtual bool SwitchOffRfField();
+    virtual bool EnterPowerDown(byte u8_WakeSources = 0);
+    void WakeUp();
             
     // ISO14443A functions
     bool ReadPassiveTargetID(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+    bool StartReadPassiveTargetID();
+    bool FinishReadPassiveTargetID(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+
+    // Inventory of up to 2 cards in the RF field
+    bool ReadPassiveTargets(kPN532Target k_Targets[PN532_MAX_TARGETS], byte* pu8_Count);
+    bool StartReadPassiveTargets();
+    bool FinishReadPassiveTargets(kPN532Target k_Targets[PN532_MAX_TARGETS], byte* pu8_Count);
+
+    // Selects the card that the following commands talk to (Desfire overrides this)
+    virtual bool SetTarget(byte u8_Tg);
+    byte GetTarget();
+
+    // Autonomous card detection by the PN532 (InAutoPoll)
+    bool      StartAutoPoll(const byte* u8_Types, byte u8_TypeCount, byte u8_Period, byte u8_PollCount);
+    ePN532Job PollResult(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+    bool      StopAutoPoll();
+
+    // Non-blocking command engine
+    ePN532Job PollCommand();
+    ePN532Job WaitCommand();
+    bool      AbortCommand();
+
+    // Checks the frame parser against a simulated PN532 (no hardware required)
+    static bool SelftestFrames();
 
  protected:	
+    // Non-blocking command engine (the response is stored in mu8_PacketBuffer)
+    bool StartCommand(byte* cmd, int cmdlen, uint32_t u32_Timeout = PN532_TIMEOUT);
+    int  FinishCommand();
+    int  ParseTargetData(const byte* pu8_Data, int s32_Len, kPN532Target* pk_Target);
+    void ParseAts(const byte* pu8_Ats, kPN532Ats* pk_Ats);
+    bool CopyTargetUid(const kPN532Target* pk_Target, byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+
+    // One trial of TuneRf(), returns 0 on success or the error code of the PN532 (Desfire overrides this)
+    virtual byte RfTrial();
+
     // Low Level functions
     bool CheckPN532Status(byte u8_Status);
-    bool SendCommandCheckAck(byte *cmd, byte cmdlen);    
-    byte ReadData    (byte* buff, byte len);
-    bool ReadPacket  (byte* buff, byte len);
-    void WriteCommand(byte* cmd,  byte cmdlen);
-    void SendPacket  (byte* buff, byte len);
+    bool SetRfConfiguration(byte u8_Item, const byte* u8_Data, int s32_Len);
+    bool SendCommandCheckAck(byte *cmd, int cmdlen);    
+    int  ReadData    (byte* buff, int len);
+    int  ReadFrame   (byte* buff, int len);
+    bool ReadPacket  (byte* buff, int len);
+    bool WriteCommand(byte* cmd,  int cmdlen);
+    void SendPacket  (byte* buff, int len);
     bool IsReady();
-    bool WaitReady();
+    bool WaitReady(uint32_t u32_Timeout = PN532_TIMEOUT);
     bool ReadAck();
-    void SpiWrite(byte c);
-    byte SpiRead(void);
+    bool TestTiming(byte u8_Trials, byte* pu8_IcType);
+    bool TestEcho(byte u8_Trial);
+    void GetSafeTiming(kPN532Timing* pk_Safe);
+    void SlowDownTiming();
+    byte GetHighestBitrate(byte u8_Mask);
 
     byte mu8_DebugLevel;   // 0, 1, or 2
-    byte mu8_PacketBuffer[PN532_PACKBUFFSIZE];
+    PN532Transport* mpi_Transport;
+
+    ePN532Job me_Job;
+    bool      mb_JobAcked;    // true -> the ACK has been received, waiting for the response
+    int       ms32_JobLength;  // the length of the response returned by ReadData()
+    uint32_t  mu32_JobStart;  // tick count when the command was sent or acknowledged
+    uint32_t  mu32_JobTimeout; // the maximum time to wait for the response after the ACK (0 = forever)
+    byte  mu8_FrameBuffer[PN532_FRAME_HEADROOM + PN532_PACKBUFFSIZE + PN532_FRAME_TAILROOM];
+    byte* mu8_PacketBuffer; // = mu8_FrameBuffer + PN532_FRAME_HEADROOM (PN532_PACKBUFFSIZE bytes)
+
+    byte mu8_Target;          // the logical target number (1 or 2) used for InDataExchange, InSelect and InPSL
+    // The following arrays are indexed with mu8_Target - 1
+    kPN532Ats mk_Ats  [PN532_MAX_TARGETS]; // the capabilities of the card from its ATS
+    byte mu8_BitrateIt[PN532_MAX_TARGETS]; // the current bit rate PN532 -> card (PN532_BITRATE_XXX)
+    byte mu8_BitrateTi[PN532_MAX_TARGETS]; // the current bit rate card -> PN532
+    bool mb_BitrateFallback;  // true -> a transmission error occurred at a higher bit rate, stay at 106 kB for the next card
 
  private:
-    byte mu8_ClkPin;
-    byte mu8_MisoPin;  
-    byte mu8_MosiPin;  
-    byte mu8_SselPin;  
     byte mu8_ResetPin;
+    byte mu8_IrqPin;
+    bool mb_PowerDown;   // true -> the PN532 sleeps and must be woken up before the next command
+    bool mb_AutoTiming;  // true -> the timing has been calibrated and is slowed down when ReadData() detects link errors
+    byte mu8_LinkErrors; // the count of invalid responses in a row
+
+    // Set from the interrupt handler when the IRQ pin goes low (only one PN532 with IRQ is supported)
+    static volatile bool mb_IrqFired;
+    static void OnIrq();
 };
 
 #endif
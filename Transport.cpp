@@ -0,0 +1,697 @@
+/**************************************************************************
+
+    The bus between the host and the PN532 (see Transport.h)
+    The code has been moved here from PN532.cpp where it was selected with #if USE_XXX switches.
+
+**************************************************************************/
+
+#include "PN532.h"
+
+PN532Transport::PN532Transport()
+{
+    mu8_DebugLevel = 0;
+
+    mk_MinTiming.u16_CsSetup   = 0;
+    mk_MinTiming.u16_InterByte = 0;
+    mk_MinTiming.u16_CsRelease = 0;
+    mk_MinTiming.u16_HalfPeriod = 0;
+    mk_Timing = mk_MinTiming;
+}
+
+/**************************************************************************
+    Enable / disable debug output to SerialClass
+    0 = Off, 1 = high level debug, 2 = low level debug (more details)
+**************************************************************************/
+void PN532Transport::SetDebugLevel(byte level)
+{
+    mu8_DebugLevel = level;
+}
+
+/**************************************************************************
+    Sets the delays that are made while talking to the PN532.
+    See kPN532Timing and the defines PN532_TIMING_XXX in Transport.h
+**************************************************************************/
+void PN532Transport::SetTiming(const kPN532Timing* pk_Timing)
+{
+    mk_Timing = *pk_Timing;
+}
+
+void PN532Transport::GetTiming(kPN532Timing* pk_Timing)
+{
+    *pk_Timing = mk_Timing;
+}
+
+// The default timing of this bus. Shorter delays are never required.
+void PN532Transport::GetMinTiming(kPN532Timing* pk_Timing)
+{
+    *pk_Timing = mk_MinTiming;
+}
+
+/**************************************************************************
+    Reads one frame from the PN532 and does NOT check for valid data.
+    The frame is read in phases (SPI: within the same chip select):
+    first the header up to the length bytes, then exactly the remaining data + checksum + postamble.
+    So short responses (e.g. errors) do not clock out unused bytes.
+    param  buff      Pointer to the buffer where the frame will be written
+    param  len       The size of buff (the maximum frame length)
+    returns the count of bytes written to buff
+**************************************************************************/
+int PN532Transport::ReadFrame(byte* buff, int len)
+{
+    BeginRead();
+
+    // Phase 1: read the optional preamble and the start code 0x00 0xFF
+    int P = 0;
+    while (P < len && (P < 2 || buff[P-2] != PN532_STARTCODE1 || buff[P-1] != PN532_STARTCODE2))
+    {
+        ReadBytes(buff + P++, 1);
+    }
+
+    // Phase 2: read the length (LEN LCS) or (0xFF 0xFF LENM LENL LCS) in an extended frame
+    int s32_DataLen = -1;
+    if (P + 2 <= len)
+    {
+        ReadBytes(buff + P, 2);
+        P += 2;
+        if (buff[P-2] == 0xFF && buff[P-1] == 0xFF && P + 3 <= len)
+        {
+            ReadBytes(buff + P, 3);
+            P += 3;
+            s32_DataLen = (buff[P-3] << 8) | buff[P-2];
+        }
+        else
+        {
+            s32_DataLen = buff[P-2];
+        }
+    }
+
+    // Phase 3: read the data + checksum + postamble (PN532::ReadData() detects a wrong length)
+    int s32_Rest = min(s32_DataLen + 2, len - P);
+    ReadBytes(buff + P, s32_Rest);
+    P += s32_Rest;
+
+    EndRead();
+    return P;
+}
+
+/**************************************************************************
+    Reads n bytes of data from the PN532 and does NOT check for valid data.
+    param  buff      Pointer to the buffer where data will be written
+    param  len       Number of bytes to read
+**************************************************************************/
+bool PN532Transport::Read(byte* buff, int len)
+{
+    BeginRead();
+    ReadBytes(buff, len);
+    EndRead();
+    return true;
+}
+
+// ########################################################################
+// ####                              SPI                              #####
+// ########################################################################
+
+SpiTransport::SpiTransport(byte u8_Sel)
+{
+    mu8_SselPin = u8_Sel;
+
+    mk_MinTiming.u16_CsSetup   = PN532_TIMING_CS_SETUP;
+    mk_MinTiming.u16_InterByte = PN532_TIMING_INTER_BYTE;
+    mk_MinTiming.u16_CsRelease = PN532_TIMING_CS_RELEASE;
+    mk_Timing = mk_MinTiming;
+}
+
+// The derived class must initialize the bus before calling this function
+void SpiTransport::Begin()
+{
+    Utils::SetPinMode(mu8_SselPin, OUTPUT);
+    WakeUp();
+}
+
+void SpiTransport::WakeUp()
+{
+    // Wake up the PN532 (chapter 7.2.11) -> send a sequence of 0x55 (dummy bytes)
+    byte u8_Buffer[20];
+    memset(u8_Buffer, PN532_WAKEUP, sizeof(u8_Buffer));
+    Write(u8_Buffer, sizeof(u8_Buffer));
+
+    if (mu8_DebugLevel > 1)
+    {
+        Utils::Print("Send WakeUp packet: ");
+        Utils::PrintHexBuf(u8_Buffer, sizeof(u8_Buffer), LF);
+    }
+}
+
+void SpiTransport::Select()
+{
+    Utils::WritePin(mu8_SselPin, LOW);
+    Utils::DelayMicro(mk_Timing.u16_CsSetup);
+}
+
+void SpiTransport::Deselect()
+{
+    Utils::WritePin(mu8_SselPin, HIGH);
+    Utils::DelayMicro(mk_Timing.u16_CsRelease);
+}
+
+/**************************************************************************
+    Return true if the PN532 is ready with a response.
+**************************************************************************/
+bool SpiTransport::IsReady()
+{
+    Select();
+
+    if (mu8_DebugLevel > 2) Utils::Print("IsReady(): write STATUSREAD\r\n");
+
+    SpiWrite(PN532_SPI_STATUSREAD);
+    byte u8_Ready = SpiRead();
+
+    if (mu8_DebugLevel > 2)
+    {
+        Utils::Print("IsReady(): read ");
+        Utils::PrintHex8(u8_Ready, LF);
+    }
+
+    Deselect();
+    return u8_Ready == PN532_SPI_READY; // 0x01
+}
+
+/**************************************************************************
+    Send a data packet
+**************************************************************************/
+void SpiTransport::Write(const byte* buff, int len)
+{
+    Select();
+
+    if (mu8_DebugLevel > 2) Utils::Print("Write(): write DATAWRITE\r\n");
+    SpiWrite(PN532_SPI_DATAWRITE);
+    SpiWriteBuf(buff, len);
+
+    Deselect();
+}
+
+void SpiTransport::BeginRead()
+{
+    Select();
+
+    if (mu8_DebugLevel > 2) Utils::Print("Read(): write DATAREAD\r\n");
+    SpiWrite(PN532_SPI_DATAREAD);
+}
+
+void SpiTransport::ReadBytes(byte* buff, int len)
+{
+    SpiReadBuf(buff, len);
+}
+
+void SpiTransport::EndRead()
+{
+    Deselect();
+}
+
+void SpiTransport::SpiWriteBuf(const byte* buff, int len)
+{
+    for (int i=0; i<len; i++)
+    {
+        Utils::DelayMicro(mk_Timing.u16_InterByte);
+        SpiWrite(buff[i]);
+    }
+}
+
+void SpiTransport::SpiReadBuf(byte* buff, int len)
+{
+    for (int i=0; i<len; i++)
+    {
+        Utils::DelayMicro(mk_Timing.u16_InterByte);
+        buff[i] = SpiRead();
+    }
+}
+
+// ------------------------------------------------------------------------
+
+/**************************************************************************
+    Software SPI
+    param  clk       SPI clock pin (SCK)
+    param  miso      SPI MISO pin
+    param  mosi      SPI MOSI pin
+    param  sel       SPI chip select pin (CS/SSEL)
+    param  period    the half period of the clock in microseconds (see PN532_SOFT_SPI_DELAY)
+**************************************************************************/
+SoftSpiTransport::SoftSpiTransport(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, uint16_t u16_HalfPeriod)
+    : SpiTransport(u8_Sel)
+{
+    mu8_ClkPin  = u8_Clk;
+    mu8_MisoPin = u8_Miso;
+    mu8_MosiPin = u8_Mosi;
+
+    mk_MinTiming.u16_HalfPeriod = PN532_SOFT_SPI_MIN_DELAY;
+    mk_Timing   .u16_HalfPeriod = u16_HalfPeriod;
+}
+
+void SoftSpiTransport::Begin()
+{
+    Utils::SetPinMode(mu8_ClkPin,  OUTPUT);
+    Utils::SetPinMode(mu8_MosiPin, OUTPUT);
+    Utils::SetPinMode(mu8_MisoPin, INPUT);
+
+    #if PN532_SOFT_SPI_REGISTERS
+        // Resolve the pins only once instead of looking them up in digitalWrite() for each clock edge
+        mpu_ClkReg    = portOutputRegister(digitalPinToPort(mu8_ClkPin));
+        mpu_MosiReg   = portOutputRegister(digitalPinToPort(mu8_MosiPin));
+        mpu_MisoReg   = portInputRegister (digitalPinToPort(mu8_MisoPin));
+        mu32_ClkMask  = digitalPinToBitMask(mu8_ClkPin);
+        mu32_MosiMask = digitalPinToBitMask(mu8_MosiPin);
+        mu32_MisoMask = digitalPinToBitMask(mu8_MisoPin);
+    #endif
+
+    SpiTransport::Begin();
+}
+
+/**************************************************************************
+    Sets the half period of the clock in microseconds (see PN532_SOFT_SPI_DELAY)
+    A value of 5 results in a clock of 100 kHz.
+**************************************************************************/
+void SoftSpiTransport::SetHalfPeriod(uint16_t u16_HalfPeriod)
+{
+    mk_Timing.u16_HalfPeriod = u16_HalfPeriod;
+}
+
+uint16_t SoftSpiTransport::GetHalfPeriod()
+{
+    return mk_Timing.u16_HalfPeriod;
+}
+
+/**************************************************************************
+    SPI write one byte (LSB first)
+    MOSI is changed while CLK is low, the PN532 samples it at the rising edge.
+    Each bit takes exactly two half periods.
+**************************************************************************/
+void SoftSpiTransport::SpiWrite(byte c)
+{
+    ClkHigh();
+    Utils::DelayMicro(mk_Timing.u16_HalfPeriod);
+
+    for (int i=1; i<=128; i<<=1)
+    {
+        ClkLow();
+        if (c & i) MosiHigh();
+        else       MosiLow();
+        Utils::DelayMicro(mk_Timing.u16_HalfPeriod);
+
+        ClkHigh();
+        Utils::DelayMicro(mk_Timing.u16_HalfPeriod);
+    }
+}
+
+/**************************************************************************
+    SPI read one byte (LSB first)
+    The PN532 changes MISO at the falling edge, it is sampled while CLK is high.
+**************************************************************************/
+byte SoftSpiTransport::SpiRead()
+{
+    ClkHigh();
+    Utils::DelayMicro(mk_Timing.u16_HalfPeriod);
+
+    int x=0;
+    for (int i=1; i<=128; i<<=1)
+    {
+        if (MisoHigh())
+        {
+            x |= i;
+        }
+        ClkLow();
+        Utils::DelayMicro(mk_Timing.u16_HalfPeriod);
+        ClkHigh();
+        Utils::DelayMicro(mk_Timing.u16_HalfPeriod);
+    }
+    return x;
+}
+
+// ------------------------------------------------------------------------
+
+#if USE_HARDWARE_SPI
+
+/**************************************************************************
+    Hardware SPI
+    param  sel       SPI chip select pin (CS/SSEL)
+    param  clock     SPI clock in Hertz (max 5 MHz)
+**************************************************************************/
+HardSpiTransport::HardSpiTransport(byte u8_Sel, uint32_t u32_Clock)
+    : SpiTransport(u8_Sel)
+{
+    mu32_Clock = min(u32_Clock, (uint32_t)PN532_HARD_SPI_MAX_CLOCK);
+}
+
+void HardSpiTransport::Begin()
+{
+    SpiClass::Begin(mu32_Clock);
+    SpiTransport::Begin();
+}
+
+void HardSpiTransport::SpiWrite(byte c)
+{
+    SpiClass::Transfer(c);
+}
+
+byte HardSpiTransport::SpiRead()
+{
+    return SpiClass::Transfer(0x00);
+}
+
+// Send the whole frame in one transaction.
+// The SPI bus overwrites the buffer with the received bytes, so the caller's buffer must be copied.
+void HardSpiTransport::SpiWriteBuf(const byte* buff, int len)
+{
+    byte u8_Burst[64];
+    if (mk_Timing.u16_InterByte > 0)
+    {
+        SpiTransport::SpiWriteBuf(buff, len);
+        return;
+    }
+
+    while (len > 0)
+    {
+        int s32_Count = min(len, (int)sizeof(u8_Burst));
+        memcpy(u8_Burst, buff, s32_Count);
+        SpiClass::Transfer(u8_Burst, s32_Count);
+        buff += s32_Count;
+        len  -= s32_Count;
+    }
+}
+
+// Read all bytes in one transaction while sending zeroes
+void HardSpiTransport::SpiReadBuf(byte* buff, int len)
+{
+    if (mk_Timing.u16_InterByte > 0)
+    {
+        SpiTransport::SpiReadBuf(buff, len);
+        return;
+    }
+
+    memset(buff, 0, len);
+    SpiClass::Transfer(buff, len);
+}
+
+#endif // USE_HARDWARE_SPI
+
+// ########################################################################
+// ####                              I2C                              #####
+// ########################################################################
+
+#if USE_HARDWARE_I2C
+
+I2cTransport::I2cTransport(uint32_t u32_Clock)
+{
+    // No delays are required. The bytes are buffered by the Wire library.
+    mu32_Clock = u32_Clock;
+    mb_Ready   = false;
+}
+
+void I2cTransport::Begin()
+{
+    I2cClass::Begin(mu32_Clock);
+}
+
+// The PN532 wakes up when it sees its address on the bus (chapter 7.2.11)
+void I2cTransport::WakeUp()
+{
+    mb_Ready = false;
+    I2cClass::BeginTransmission(PN532_I2C_ADDRESS);
+    I2cClass::EndTransmission();
+}
+
+/**************************************************************************
+    Return true if the PN532 is ready with a response.
+    The PN532 stays ready until the response has been read. So once it has reported Ready 
+    the status is not read again: the ready byte is read together with the frame in Read().
+**************************************************************************/
+bool I2cTransport::IsReady()
+{
+    if (mb_Ready)
+        return true;
+
+    // After reading this byte, the bus must be released with a Stop condition
+    I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, (byte)1);
+
+    // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
+    byte u8_Ready = I2cClass::Read();
+    if (mu8_DebugLevel > 2)
+    {
+        Utils::Print("IsReady(): read ");
+        Utils::PrintHex8(u8_Ready, LF);
+    }
+
+    mb_Ready = (u8_Ready == PN532_I2C_READY); // 0x01
+    return mb_Ready;
+}
+
+/**************************************************************************
+    Send a data packet
+**************************************************************************/
+void I2cTransport::Write(const byte* buff, int len)
+{
+    mb_Ready = false;
+    Utils::DelayMicro(mk_Timing.u16_CsSetup);
+
+    I2cClass::BeginTransmission(PN532_I2C_ADDRESS);
+    for (int i=0; i<len; i++)
+    {
+        I2cClass::Write(buff[i]);
+    }
+    I2cClass::EndTransmission();
+    Utils::DelayMicro(mk_Timing.u16_CsRelease);
+}
+
+// The Wire library reads a fixed count in one transaction, which cannot be extended after the header has been parsed.
+// A longer frame is cut at PN532_I2C_MAX_READ bytes and rejected by PN532::ReadData().
+int I2cTransport::ReadFrame(byte* buff, int len)
+{
+    len = min(len, PN532_I2C_MAX_READ);
+    if (!Read(buff, len))
+        return 0;
+
+    return len;
+}
+
+/**************************************************************************
+    Reads n bytes of data from the PN532 and does NOT check for valid data.
+**************************************************************************/
+bool I2cTransport::Read(byte* buff, int len)
+{
+    if (len > PN532_I2C_MAX_READ)
+    {
+        Utils::Print("I2cTransport::Read(): len is invalid\r\n");
+        return false;
+    }
+
+    mb_Ready = false;
+    Utils::DelayMicro(mk_Timing.u16_CsSetup);
+
+    // read (n+1 to take into account leading Ready byte)
+    I2cClass::RequestFrom((byte)PN532_I2C_ADDRESS, (byte)(len+1));
+
+    // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
+    // It is ignored here because it has been checked already in IsReady()
+    byte u8_Ready = I2cClass::Read();
+    if (mu8_DebugLevel > 2)
+    {
+        Utils::Print("Read(): read ");
+        Utils::PrintHex8(u8_Ready, LF);
+    }
+
+    ReadBytes(buff, len);
+    Utils::DelayMicro(mk_Timing.u16_CsRelease);
+    return true;
+}
+
+void I2cTransport::ReadBytes(byte* buff, int len)
+{
+    for (int i=0; i<len; i++)
+    {
+        Utils::DelayMicro(mk_Timing.u16_InterByte);
+        buff[i] = I2cClass::Read();
+    }
+}
+
+#endif // USE_HARDWARE_I2C
+
+// ########################################################################
+// ####                              HSU                              #####
+// ########################################################################
+
+#if USE_HARDWARE_HSU
+
+HsuTransport::HsuTransport()
+{
+    // No delays are required. The bytes are buffered by the UART.
+}
+
+void HsuTransport::Begin()
+{
+    // After a reset the PN532 always starts with 115200 baud
+    HsuClass::Begin(PN532_HSU_BAUD);
+    WakeUp();
+}
+
+void HsuTransport::WakeUp()
+{
+    // Wake up the PN532 (chapter 7.2.11) -> send 0x55 0x55 followed by a long preamble of zeroes
+    byte u8_Buffer[16];
+    memset(u8_Buffer, 0, sizeof(u8_Buffer));
+    u8_Buffer[0] = PN532_WAKEUP;
+    u8_Buffer[1] = PN532_WAKEUP;
+    Write(u8_Buffer, sizeof(u8_Buffer));
+}
+
+void HsuTransport::SetBaudRate(uint32_t u32_Baud)
+{
+    HsuClass::Begin(u32_Baud);
+}
+
+// In HSU mode there is no status byte. The PN532 simply starts sending when the response is ready.
+bool HsuTransport::IsReady()
+{
+    return HsuClass::Available() > 0;
+}
+
+void HsuTransport::Write(const byte* buff, int len)
+{
+    // Throw away the rest of an old response that has not been read. Otherwise it would be taken as the next response.
+    HsuClass::Discard();
+    Utils::DelayMicro(mk_Timing.u16_CsSetup);
+    HsuClass::Write(buff, len);
+    Utils::DelayMicro(mk_Timing.u16_CsRelease);
+}
+
+// Incomplete data is filled with zeroes. PN532::ReadData() detects the invalid frame.
+void HsuTransport::ReadBytes(byte* buff, int len)
+{
+    int s32_Read = HsuClass::Read(buff, len, PN532_HSU_TIMEOUT);
+    memset(buff + s32_Read, 0, len - s32_Read);
+}
+
+#endif // USE_HARDWARE_HSU
+
+// ########################################################################
+// ####                           LOOPBACK                            #####
+// ########################################################################
+
+LoopbackTransport::LoopbackTransport()
+{
+    ms32_RxCount = 0;
+    ms32_RxPos   = 0;
+    ms32_TxCount = 0;
+}
+
+// Discards all responses that have not been read
+void LoopbackTransport::Begin()
+{
+    ms32_RxCount = 0;
+    ms32_RxPos   = 0;
+    ms32_TxCount = 0;
+}
+
+bool LoopbackTransport::IsReady()
+{
+    return ms32_RxPos < ms32_RxCount;
+}
+
+/**************************************************************************
+    Stores the frame that the host has sent (see GetSentFrame()).
+    A command frame is acknowledged immediately like the PN532 does.
+    The ACK is inserted before the response that has been injected for this command.
+**************************************************************************/
+void LoopbackTransport::Write(const byte* buff, int len)
+{
+    ms32_TxCount = min(len, (int)sizeof(mu8_TxData));
+    memcpy(mu8_TxData, buff, ms32_TxCount);
+
+    // A command frame contains 0xD4 (PN532_HOSTTOPN532), the wake up sequence and an ACK from the host do not.
+    if (memchr(buff, PN532_HOSTTOPN532, len) == NULL)
+        return;
+
+    const byte Ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+    if (ms32_RxCount + (int)sizeof(Ack) > (int)sizeof(mu8_RxData))
+        return;
+
+    memmove(mu8_RxData + ms32_RxPos + sizeof(Ack), mu8_RxData + ms32_RxPos, ms32_RxCount - ms32_RxPos);
+    memcpy (mu8_RxData + ms32_RxPos, Ack, sizeof(Ack));
+    ms32_RxCount += sizeof(Ack);
+}
+
+/**************************************************************************
+    Queues a response that will be read after the next command.
+    u8_Data = the response data without the leading 0xD5 (PN532_PN532TOHOST)
+    e.g. for GetFirmwareVersion: 0x03, 0x32, 0x01, 0x06, 0x07
+    The frame with length and checksums is built here.
+**************************************************************************/
+bool LoopbackTransport::InjectResponse(const byte* u8_Data, int s32_Count)
+{
+    byte u8_Frame[PN532_LOOPBACK_SIZE];
+    int s32_Len = s32_Count + 1; // TFI + data
+    if (s32_Len + 11 > (int)sizeof(u8_Frame))
+        return false;
+
+    int P=0;
+    u8_Frame[P++] = PN532_PREAMBLE;
+    u8_Frame[P++] = PN532_STARTCODE1;
+    u8_Frame[P++] = PN532_STARTCODE2;
+    if (s32_Len <= 0xFF)
+    {
+        u8_Frame[P++] = s32_Len;
+        u8_Frame[P++] = 0x100 - s32_Len;
+    }
+    else // extended frame
+    {
+        byte u8_LenM = s32_Len >> 8;
+        byte u8_LenL = s32_Len & 0xFF;
+        u8_Frame[P++] = 0xFF;
+        u8_Frame[P++] = 0xFF;
+        u8_Frame[P++] = u8_LenM;
+        u8_Frame[P++] = u8_LenL;
+        u8_Frame[P++] = 0x100 - (byte)(u8_LenM + u8_LenL);
+    }
+
+    byte checksum = PN532_PN532TOHOST;
+    u8_Frame[P++] = PN532_PN532TOHOST;
+    for (int i=0; i<s32_Count; i++)
+    {
+        checksum += u8_Data[i];
+        u8_Frame[P++] = u8_Data[i];
+    }
+    u8_Frame[P++] = ~checksum + 1;
+    u8_Frame[P++] = PN532_POSTAMBLE;
+
+    return InjectBytes(u8_Frame, P);
+}
+
+// Queues raw bytes (e.g. an invalid frame) that will be read by the host
+bool LoopbackTransport::InjectBytes(const byte* u8_Data, int s32_Count)
+{
+    // Remove the bytes that have already been read
+    memmove(mu8_RxData, mu8_RxData + ms32_RxPos, ms32_RxCount - ms32_RxPos);
+    ms32_RxCount -= ms32_RxPos;
+    ms32_RxPos    = 0;
+
+    if (ms32_RxCount + s32_Count > (int)sizeof(mu8_RxData))
+        return false;
+
+    memcpy(mu8_RxData + ms32_RxCount, u8_Data, s32_Count);
+    ms32_RxCount += s32_Count;
+    return true;
+}
+
+// Returns the last frame that the host has sent
+int LoopbackTransport::GetSentFrame(const byte** pu8_Frame)
+{
+    *pu8_Frame = mu8_TxData;
+    return ms32_TxCount;
+}
+
+// Bytes that are read after the end of the injected data are zero like on a real bus.
+void LoopbackTransport::ReadBytes(byte* buff, int len)
+{
+    int s32_Count = min(len, ms32_RxCount - ms32_RxPos);
+    memcpy(buff, mu8_RxData + ms32_RxPos, s32_Count);
+    memset(buff + s32_Count, 0, len - s32_Count);
+    ms32_RxPos += s32_Count;
+}
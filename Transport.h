@@ -0,0 +1,312 @@
+/**************************************************************************
+
+    The bus between the host and the PN532.
+    Each transport only moves frames over the bus. The frame format itself is built and checked in PN532.cpp.
+    A transport is passed to the constructor of PN532, so one sketch can drive several readers on different buses.
+
+    Which transports are available depends on the USE_XXX switches in Utils.h.
+    Software SPI and the Loopback transport have no dependencies and are always available.
+
+**************************************************************************/
+
+#ifndef PN532_TRANSPORT_H
+#define PN532_TRANSPORT_H
+
+#include "Utils.h"
+
+// This parameter may be used to slow down the software SPI bus speed.
+// This is required when there is a long cable between the PN532 and the Teensy.
+// This delay in microseconds (not milliseconds!) is the half period of the CLK line (the time between two edges).
+// Instead of checking the speed with an oscilloscope call PN532::CalibrateTiming() which finds the fastest clock that works.
+// A value of 5 microseconds results in a clock signal of 100 kHz, 50 microseconds results in 10 kHz.
+// A value of 0 results in maximum speed (depends on CPU speed).
+// ATTENTION: The PN532 supports max 5 MHz. Do not use 0 on processors that are faster than 48 MHz.
+// The default can be changed at runtime with SoftSpiTransport::SetHalfPeriod().
+// This parameter is not used for hardware SPI mode.
+#define PN532_SOFT_SPI_DELAY  5
+
+// The shortest half period that PN532::CalibrateTiming() tries (500 kHz). This is safe on any processor.
+#define PN532_SOFT_SPI_MIN_DELAY  1
+
+// Software SPI toggles the port registers of the processor directly instead of calling digitalWrite() / digitalRead()
+// which is 10 to 50 times faster. This requires the Arduino macros portOutputRegister() etc. which are defined
+// for AVR, Teensy, SAM and ESP boards. On other boards software SPI falls back to digitalWrite() / digitalRead().
+#if defined(portOutputRegister) && defined(portInputRegister) && defined(digitalPinToPort) && defined(digitalPinToBitMask)
+    #define PN532_SOFT_SPI_REGISTERS  TRUE
+    typedef decltype(portOutputRegister(digitalPinToPort(0))) kOutRegister; // volatile uint8_t* or volatile uint32_t*
+    typedef decltype(portInputRegister (digitalPinToPort(0))) kInRegister;
+#else
+    #define PN532_SOFT_SPI_REGISTERS  FALSE
+#endif
+
+// The default clock (in Hertz) when using Hardware SPI mode (see HardSpiTransport)
+// The PN532 supports up to 5 MHz (PN532_HARD_SPI_MAX_CLOCK). Higher values are limited to this.
+// This parameter is not used for software SPI mode.
+#define PN532_HARD_SPI_CLOCK      1000000
+#define PN532_HARD_SPI_MAX_CLOCK  5000000
+
+// The clock (in Hertz) of the I2C bus (see I2cTransport)
+// The PN532 is specified for Standard mode and Fast mode. Fast mode Plus works only with short wires, 
+// strong pull-up resistors and if all other devices on the bus support it.
+// This parameter is only used for I2C mode.
+#define PN532_I2C_STANDARD_MODE    100000
+#define PN532_I2C_FAST_MODE        400000
+#define PN532_I2C_FAST_MODE_PLUS  1000000
+#define PN532_I2C_CLOCK           PN532_I2C_FAST_MODE
+
+// The maximum count of bytes that I2cTransport reads in one transaction.
+// The Wire library takes the count as a byte, and the PN532 sends the Ready byte in front of the data.
+// So extended frames longer than this cannot be received over I2C.
+#define PN532_I2C_MAX_READ        254
+
+// The baudrate of the PN532 in HSU mode after a reset. (see PN532::SetSerialBaudRate())
+// This parameter is only used for HSU mode.
+#define PN532_HSU_BAUD        115200
+
+// The maximum time in milliseconds to wait for the next byte of a frame in HSU mode
+#define PN532_HSU_TIMEOUT     100
+
+// The default timing of the SPI interface in microseconds (see struct kPN532Timing).
+// These are the minimums from the PN532 datasheet: the SPI setup / hold times are specified in nanoseconds,
+// so 1 microsecond is already above the limit. Only the wake-up from power down requires 2 ms. (See PN532::begin())
+// I2C and HSU do not need any delays. Their default timing is zero.
+// If your wiring needs more, call PN532::CalibrateTiming() once after begin() instead of modifying these values.
+#define PN532_TIMING_CS_SETUP      1 // SPI: delay after pulling the chip select low
+#define PN532_TIMING_INTER_BYTE    0 // SPI: delay between two bytes of the same frame
+#define PN532_TIMING_CS_RELEASE    1 // SPI: delay after releasing the chip select
+
+// The size of the receive and send buffers of the LoopbackTransport
+#define PN532_LOOPBACK_SIZE   300
+
+#define PN532_WAKEUP                        (0x55)
+
+#define PN532_SPI_STATUSREAD                (0x02)
+#define PN532_SPI_DATAWRITE                 (0x01)
+#define PN532_SPI_DATAREAD                  (0x03)
+#define PN532_SPI_READY                     (0x01)
+
+#define PN532_I2C_ADDRESS                   (0x48 >> 1)
+#define PN532_I2C_READY                     (0x01)
+
+// The wake up sources of PN532::EnterPowerDown() (chapter 7.2.11)
+#define PN532_WAKE_INT0                     (0x01) // pin P32
+#define PN532_WAKE_INT1                     (0x02) // pin P33
+#define PN532_WAKE_RF                       (0x08) // RF level detector: an external RF field (e.g. a phone), NOT a passive card
+#define PN532_WAKE_HSU                      (0x10)
+#define PN532_WAKE_SPI                      (0x20)
+#define PN532_WAKE_GPIO                     (0x40) // pins P34, P71, P72
+#define PN532_WAKE_I2C                      (0x80)
+
+// The delays (in microseconds) that the host makes while talking to the PN532.
+// A value of 0 means no delay at all.
+// ATTENTION: Values above 16000 are not allowed because delayMicroseconds() is not precise anymore.
+struct kPN532Timing
+{
+    uint16_t u16_CsSetup;   // after pulling the chip select low (SPI) or before starting a transmission (I2C, HSU)
+    uint16_t u16_InterByte; // between two bytes of the same frame
+    uint16_t u16_CsRelease; // after releasing the chip select (SPI) or after the end of a transmission (I2C, HSU)
+    uint16_t u16_HalfPeriod; // the half period of the clock (only software SPI, always 0 on the other buses)
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// The abstract base class of all transports
+class PN532Transport
+{
+ public:
+    PN532Transport();
+
+    // Initializes the bus and wakes up the PN532 (chapter 7.2.11)
+    virtual void Begin() = 0;
+    // Returns true if the PN532 has a response that can be read
+    virtual bool IsReady() = 0;
+    // Sends one complete frame
+    virtual void Write(const byte* buff, int len) = 0;
+    // Reads one frame, returns the count of bytes written to buff or 0 on error (see PN532::ReadFrame())
+    virtual int  ReadFrame(byte* buff, int len);
+    // Reads exactly len bytes without looking at the frame
+    virtual bool Read(byte* buff, int len);
+    // Changes the baudrate of the host (only HSU)
+    virtual void SetBaudRate(uint32_t u32_Baud) {}
+    // Wakes up the PN532 from power down (chapter 7.2.11)
+    virtual void WakeUp() {}
+    // Returns the wake up source of this bus (PN532_WAKE_XXX) which must be enabled in power down
+    virtual byte GetWakeSource() { return 0; }
+
+    void SetDebugLevel(byte level);
+    void SetTiming(const kPN532Timing* pk_Timing);
+    void GetTiming(kPN532Timing* pk_Timing);
+    void GetMinTiming(kPN532Timing* pk_Timing);
+
+ protected:
+    // Read() and ReadFrame() call BeginRead(), then ReadBytes() one or more times, then EndRead()
+    virtual void BeginRead() {}
+    virtual void ReadBytes(byte* buff, int len) = 0;
+    virtual void EndRead() {}
+
+    byte         mu8_DebugLevel;
+    kPN532Timing mk_Timing;
+    kPN532Timing mk_MinTiming; // the default timing, also the lower limit for PN532::CalibrateTiming()
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// The SPI protocol of the PN532 (chapter 6.2.5) which is the same for hardware and software SPI
+class SpiTransport : public PN532Transport
+{
+ public:
+    SpiTransport(byte u8_Sel);
+
+    virtual void Begin();
+    virtual bool IsReady();
+    virtual void Write(const byte* buff, int len);
+    virtual void WakeUp();
+    virtual byte GetWakeSource() { return PN532_WAKE_SPI; }
+
+ protected:
+    virtual void BeginRead();
+    virtual void ReadBytes(byte* buff, int len);
+    virtual void EndRead();
+
+    // Write / read one byte
+    virtual void SpiWrite(byte c) = 0;
+    virtual byte SpiRead() = 0;
+    // Write / read a block of bytes while the chip select is low
+    virtual void SpiWriteBuf(const byte* buff, int len);
+    virtual void SpiReadBuf (byte* buff, int len);
+
+    void Select();
+    void Deselect();
+
+    byte mu8_SselPin;
+};
+
+// Software SPI with 4 regular digital pins (used by the DoorOpener sketch)
+class SoftSpiTransport : public SpiTransport
+{
+ public:
+    SoftSpiTransport(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, uint16_t u16_HalfPeriod = PN532_SOFT_SPI_DELAY);
+
+    virtual void Begin();
+    void SetHalfPeriod(uint16_t u16_HalfPeriod);
+    uint16_t GetHalfPeriod();
+
+ protected:
+    virtual void SpiWrite(byte c);
+    virtual byte SpiRead();
+
+    #if PN532_SOFT_SPI_REGISTERS
+        // The registers are resolved once in Begin()
+        inline void ClkHigh()            { *mpu_ClkReg  |=  mu32_ClkMask; }
+        inline void ClkLow()             { *mpu_ClkReg  &= ~mu32_ClkMask; }
+        inline void MosiHigh()           { *mpu_MosiReg |=  mu32_MosiMask; }
+        inline void MosiLow()            { *mpu_MosiReg &= ~mu32_MosiMask; }
+        inline bool MisoHigh()           { return (*mpu_MisoReg & mu32_MisoMask) != 0; }
+
+        kOutRegister mpu_ClkReg;
+        kOutRegister mpu_MosiReg;
+        kInRegister  mpu_MisoReg;
+        uint32_t     mu32_ClkMask;
+        uint32_t     mu32_MosiMask;
+        uint32_t     mu32_MisoMask;
+    #else
+        inline void ClkHigh()            { Utils::WritePin(mu8_ClkPin,  HIGH); }
+        inline void ClkLow()             { Utils::WritePin(mu8_ClkPin,  LOW);  }
+        inline void MosiHigh()           { Utils::WritePin(mu8_MosiPin, HIGH); }
+        inline void MosiLow()            { Utils::WritePin(mu8_MosiPin, LOW);  }
+        inline bool MisoHigh()           { return Utils::ReadPin(mu8_MisoPin) != LOW; }
+    #endif
+
+    byte     mu8_ClkPin;
+    byte     mu8_MisoPin;
+    byte     mu8_MosiPin;
+};
+
+#if USE_HARDWARE_SPI
+    // Hardware SPI (see SpiClass in Utils.h)
+    class HardSpiTransport : public SpiTransport
+    {
+     public:
+        HardSpiTransport(byte u8_Sel, uint32_t u32_Clock = PN532_HARD_SPI_CLOCK);
+
+        virtual void Begin();
+
+     protected:
+        virtual void SpiWrite(byte c);
+        virtual byte SpiRead();
+        virtual void SpiWriteBuf(const byte* buff, int len);
+        virtual void SpiReadBuf (byte* buff, int len);
+
+        uint32_t mu32_Clock;
+    };
+#endif
+
+#if USE_HARDWARE_I2C
+    // Hardware I2C (see I2cClass in Utils.h)
+    class I2cTransport : public PN532Transport
+    {
+     public:
+        I2cTransport(uint32_t u32_Clock = PN532_I2C_CLOCK);
+
+        virtual void Begin();
+        virtual bool IsReady();
+        virtual void Write(const byte* buff, int len);
+        virtual int  ReadFrame(byte* buff, int len);
+        virtual bool Read(byte* buff, int len);
+        virtual void WakeUp();
+        virtual byte GetWakeSource() { return PN532_WAKE_I2C; }
+
+     protected:
+        virtual void ReadBytes(byte* buff, int len);
+
+        uint32_t mu32_Clock;
+        bool     mb_Ready; // true -> the last status read returned Ready and the response has not been read yet
+    };
+#endif
+
+#if USE_HARDWARE_HSU
+    // High Speed UART (see HsuClass in Utils.h)
+    class HsuTransport : public PN532Transport
+    {
+     public:
+        HsuTransport();
+
+        virtual void Begin();
+        virtual bool IsReady();
+        virtual void Write(const byte* buff, int len);
+        virtual void SetBaudRate(uint32_t u32_Baud);
+        virtual void WakeUp();
+        virtual byte GetWakeSource() { return PN532_WAKE_HSU; }
+
+     protected:
+        virtual void ReadBytes(byte* buff, int len);
+    };
+#endif
+
+// A PN532 simulated in memory without any latency (for tests and benchmarks, see PN532::SelftestFrames()).
+// Each command frame is acknowledged automatically.
+// The responses must be queued with InjectResponse() before the command is sent.
+class LoopbackTransport : public PN532Transport
+{
+ public:
+    LoopbackTransport();
+
+    virtual void Begin();
+    virtual bool IsReady();
+    virtual void Write(const byte* buff, int len);
+
+    bool InjectResponse(const byte* u8_Data, int s32_Count);
+    bool InjectBytes   (const byte* u8_Data, int s32_Count);
+    int  GetSentFrame  (const byte** pu8_Frame);
+
+ protected:
+    virtual void ReadBytes(byte* buff, int len);
+
+    byte mu8_RxData[PN532_LOOPBACK_SIZE]; // the bytes that the simulated PN532 will send to the host
+    int  ms32_RxCount;
+    int  ms32_RxPos;
+    byte mu8_TxData[PN532_LOOPBACK_SIZE]; // the last frame that the host has sent
+    int  ms32_TxCount;
+};
+
+#endif
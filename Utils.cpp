@@ -170,7 +170,8 @@ uint32_t Utils::CalcCrc32(const byte* u8_Data1, int s32_Length1, // data to proc
     return u32_Crc;
 }
 
-// private
+// Continues the CRC32 u32_Crc over the next data (start with 0xFFFFFFFF).
+// This allows to calculate the CRC over data that arrives in several frames.
 uint32_t Utils::CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc)
 {
     for (int i=0; i<s32_Length; i++)
@@ -15,27 +15,31 @@
 #endif
 
 // *********************************************************************************
-// The following switches define how the Teensy communicates with the PN532 board.
+// The following switches define which buses are compiled in to communicate with the PN532 board.
+// The bus of each PN532 instance is selected at runtime with the transport that is passed to its constructor (see Transport.h)
+// Several switches may be true at the same time to drive readers on different buses.
 // For the DoorOpener sketch the only valid option is Software SPI.
-// For other projects with the PN532 you may change this.
-// ATTENTION: Only one of the following defines must be set to true!
+// ATTENTION: The MFRC522 class does not use transports. It requires that only one of the following defines is set to true!
 // NOTE: In Software SPI mode there is no external libraray required. Only 4 regular digital pins are used.
 // If you want to transfer the code to another processor the easiest way will be to use Software SPI mode.
 #define USE_SOFTWARE_SPI   TRUE   // Visual Studio needs this in upper case
 #define USE_HARDWARE_SPI   FALSE  // Visual Studio needs this in upper case
 #define USE_HARDWARE_I2C   FALSE  // Visual Studio needs this in upper case
+#define USE_HARDWARE_HSU   FALSE  // Visual Studio needs this in upper case
 // ********************************************************************************/
 
 
 #if USE_HARDWARE_SPI
     #include <SPI.h>  // Hardware SPI bus
-#elif USE_HARDWARE_I2C
+#endif
+#if USE_HARDWARE_I2C
     #include <Wire.h> // Hardware I2C bus
-#elif USE_SOFTWARE_SPI
-    // no #include required
-#else
-    #error "You must specify the PN532 communication mode."
 #endif
+#if USE_HARDWARE_HSU
+    // The PN532 is connected to this hardware UART (TX -> RX, RX -> TX)
+    #define HSU_SERIAL  Serial1
+#endif
+// Software SPI: no #include required
 
 #define LF  "\r\n" // LineFeed 
 
@@ -83,7 +87,7 @@ public:
 
 #if USE_HARDWARE_SPI
     // This class implements Hardware SPI (4 wire bus). It is not used for the DoorOpener sketch.
-    // NOTE: This class is not used when you switched to I2C mode with PN532::InitI2C() or Software SPI mode with PN532::InitSoftwareSPI().
+    // NOTE: This class is only used by HardSpiTransport (see Transport.h).
     class SpiClass
     {  
     public:
@@ -97,6 +101,12 @@ public:
         {
             return SPI.transfer(u8_Data);
         }
+        // Sends the entire buffer in one bus transaction and overwrites it with the bytes received on the MISO pin.
+        // The Arduino core uses the SPI FIFO or DMA for this where the processor supports it.
+        static inline void Transfer(byte* pu8_Buffer, int s32_Count) 
+        {
+            SPI.transfer(pu8_Buffer, s32_Count);
+        }
     };
 #endif
 
@@ -104,14 +114,15 @@ public:
 
 #if USE_HARDWARE_I2C
     // This class implements Hardware I2C (2 wire bus with pull-up resistors). It is not used for the DoorOpener sketch.
-    // NOTE: This class is not used when you switched to SPI mode with PN532::InitSoftwareSPI() or PN532::InitHardwareSPI().
+    // NOTE: This class is only used by I2cTransport (see Transport.h).
     class I2cClass
     {  
     public:
-        // Initialize the I2C pins
-        static inline void Begin() 
+        // Initialize the I2C pins and set the bus clock (100 kHz = Standard mode, 400 kHz = Fast mode)
+        static inline void Begin(uint32_t u32_Clock) 
         {
             Wire.begin();
+            Wire.setClock(u32_Clock);
         }
         // --------------------- READ -------------------------
         // Read the requested amount of bytes at once from the I2C bus into an internal buffer.
@@ -147,6 +158,48 @@ public:
 
 // -------------------------------------------------------------------------------------------------------------------
 
+#if USE_HARDWARE_HSU
+    // This class implements the High Speed UART of the PN532 (2 wires + GND). It is not used for the DoorOpener sketch.
+    // The PN532 must be switched to HSU mode with the jumpers / DIP switches on the board.
+    class HsuClass
+    {  
+    public:
+        // Open the UART or change the baudrate
+        static inline void Begin(uint32_t u32_Baud) 
+        {
+            HSU_SERIAL.begin(u32_Baud);
+        }
+        // returns how many bytes have been received which have not yet been read with Read()
+        static inline int Available()
+        {
+            return HSU_SERIAL.available();
+        }
+        // Discard all bytes that have been received but not yet read (e.g. the rest of an invalid frame)
+        static inline void Discard()
+        {
+            while (HSU_SERIAL.available())
+            {
+                HSU_SERIAL.read();
+            }
+        }
+        // Write the entire buffer and wait until it has been sent
+        static inline void Write(const byte* u8_Data, int s32_Count)
+        {
+            HSU_SERIAL.write(u8_Data, s32_Count);
+            HSU_SERIAL.flush();
+        }
+        // Read s32_Count bytes from the receive buffer, waits max u32_Timeout milliseconds.
+        // returns the count of bytes read
+        static inline int Read(byte* u8_Data, int s32_Count, uint32_t u32_Timeout)
+        {
+            HSU_SERIAL.setTimeout(u32_Timeout);
+            return HSU_SERIAL.readBytes(u8_Data, s32_Count);
+        }
+    };
+#endif
+
+// -------------------------------------------------------------------------------------------------------------------
+
 class Utils
 {
 public:
@@ -163,11 +216,12 @@ public:
         delay(s32_MilliSeconds);
     }
 
-    // This function is only required for Software SPI mode.
+    // A delay of zero returns immediately. (On some boards delayMicroseconds(0) waits much longer than expected)
     // If you compile on Visual Studio see WinDefines.h
     static inline void DelayMicro(int s32_MicroSeconds)
     {
-        delayMicroseconds(s32_MicroSeconds);
+        if (s32_MicroSeconds > 0)
+            delayMicroseconds(s32_MicroSeconds);
     }
     
     // Defines if a digital processor pin is used as input or output
@@ -194,6 +248,19 @@ public:
         return digitalRead(u8_Pin);
     }
 
+    // Calls pf_Handler from an interrupt whenever the digital pin u8_Pin goes from HIGH to LOW.
+    // If you compile on Visual Studio see WinDefines.h
+    static inline void AttachInterrupt(byte u8_Pin, void (*pf_Handler)())
+    {
+        attachInterrupt(digitalPinToInterrupt(u8_Pin), pf_Handler, FALLING);
+    }
+
+    // If you compile on Visual Studio see WinDefines.h
+    static inline void DetachInterrupt(byte u8_Pin)
+    {
+        detachInterrupt(digitalPinToInterrupt(u8_Pin));
+    }
+
     static uint64_t GetMillis64();
     static void     Print(const char*   s8_Text,  const char* s8_LF=NULL);
     static void     PrintDec  (int      s32_Data, const char* s8_LF=NULL);
@@ -209,11 +276,9 @@ public:
     static void     XorDataBlock(byte* u8_Data, const byte* u8_Xor, int s32_Length);
     static uint16_t CalcCrc16(const byte* u8_Data,  int s32_Length);
     static uint32_t CalcCrc32(const byte* u8_Data1, int s32_Length1, const byte* u8_Data2=NULL, int s32_Length2=0);
+    static uint32_t CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc); // continues a CRC over the next data
     static int      strnicmp(const char* str1, const char* str2, uint32_t u32_MaxCount);
     static int      stricmp (const char* str1, const char* str2);
-
-private:
-    static uint32_t CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc);
 };
 
 #endif // UTILS_H
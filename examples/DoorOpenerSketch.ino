@@ -70,6 +70,9 @@
 #define SPI_MOSI_PIN      4
 // The software SPI SSEL pin (Chip Select)
 #define SPI_CS_PIN        0
+// The PN532 IRQ pin (optional). If it is connected, the response of the PN532 is detected without polling.
+// The pin must support interrupts. Set PN532_NO_IRQ if the pin is not connected.
+#define PN532_IRQ_PIN     PN532_NO_IRQ
  
 // This Arduino / Teensy pin is connected to the green LED in a two color LED.
 // The green LED flashes fast while no card is present and flashes 1 second when opening the door.
@@ -113,14 +116,16 @@
 // The interval in milliseconds that the relay is powered which opens the door
 #define OPEN_INTERVAL   100
 
-// This is the interval that the RF field is switched off to save battery.
+// This is the interval that the PN532 sleeps in power down mode to save battery.
 // The shorter this interval, the more power is consumed by the PN532.
 // The longer  this interval, the longer the user has to wait until the door opens.
-// The recommended interval is 1000 ms.
+// In power down the PN532 consumes much less than with only the RF field switched off,
+// so the interval can be shorter than the former 1000 ms with the same battery consumption.
+// The recommended interval is 500 ms.
 // Please note that the slowness of reading a Desfire card is not caused by this interval.
-// The SPI bus speed is throttled to 10 kHz, which allows to transmit the data over a long cable, 
+// The SPI bus speed is throttled to 100 kHz, which allows to transmit the data over a long cable, 
 // but this obviously makes reading the card slower.
-#define RF_OFF_INTERVAL  1000
+#define RF_OFF_INTERVAL  500
 
 // ######################################################################################
 
@@ -135,6 +140,11 @@
     #warning "This code has not been tested on any other board than Teensy 3.1 / 3.2"
 #endif
 
+// Software SPI is configured to run a slow clock of 100 kHz which can be transmitted over longer cables.
+// If the cable is very long pass a longer half period to the constructor (50 microseconds = 10 kHz).
+#include "Transport.h"
+SoftSpiTransport gi_Transport(SPI_CLK_PIN, SPI_MISO_PIN, SPI_MOSI_PIN, SPI_CS_PIN);
+
 #if USE_DESFIRE
     #if USE_AES
         #define DESFIRE_KEY_TYPE   AES
@@ -147,11 +157,11 @@
     #include "Desfire.h"
     #include "Secrets.h"
     #include "Buffer.h"
-    Desfire          gi_PN532; // The class instance that communicates with Mifare Desfire cards   
+    Desfire          gi_PN532(&gi_Transport, RESET_PIN); // The class instance that communicates with Mifare Desfire cards   
     DESFIRE_KEY_TYPE gi_PiccMasterKey;
 #else
     #include "Classic.h"
-    Classic          gi_PN532; // The class instance that communicates with Mifare Classic cards
+    Classic          gi_PN532(&gi_Transport, RESET_PIN); // The class instance that communicates with Mifare Classic cards
 #endif
 
 #include "UserManager.h"
@@ -189,6 +199,8 @@ uint32_t   gu32_CommandPos   = 0;     // Index in gs8_CommandBuffer
 uint64_t   gu64_LastPasswd   = 0;     // Timestamp when the user has enetered the password successfully
 uint64_t   gu64_LastID       = 0;     // The last card UID that has been read by the RFID reader  
 bool       gb_InitSuccess    = false; // true if the PN532 has been initialized successfully
+bool       gb_Detecting      = false; // true while the PN532 searches for a card in the background (see loop())
+bool       gb_CardPresent    = false; // true while the Desfire card gu64_LastID stays on the reader with the RF field on (see loop())
 eBattCheck ge_BattCheck      = BATT_OK;
 
 void setup() 
@@ -214,8 +226,7 @@ void setup()
     // Use the internal reference voltage (1.2V) as analog reference
     //analogReference(INTERNAL1V2);
 
-    // Software SPI is configured to run a slow clock of 10 kHz which can be transmitted over longer cables.
-    gi_PN532.InitSoftwareSPI(SPI_CLK_PIN, SPI_MISO_PIN, SPI_MOSI_PIN, SPI_CS_PIN, RESET_PIN);
+    gi_PN532.SetIrqPin(PN532_IRQ_PIN);
 
     // Open USB serial port
     SerialClass::Begin(115200);
@@ -247,11 +258,12 @@ void loop()
         // While the user is typing do not read the card to avoid delays and debug output.
         if (b_KeyPress)
         {
+            StopCardDetection();
             u64_LastRead = u64_StartTick + 1000; // Give the user 1000 ms + RF_OFF_INTERVAL between each character
             return;
         }
 
-        // Turn on the RF field for 100 ms then turn it off for one second (RF_OFF_INTERVAL) to safe battery
+        // Turn on the RF field for 100 ms then put the PN532 into power down for RF_OFF_INTERVAL to safe battery
         if ((int)(u64_StartTick - u64_LastRead) < RF_OFF_INTERVAL)
             return;
     }
@@ -264,9 +276,38 @@ void loop()
             break;
         }
 
+        // The Desfire card of the last cycle is still selected: only check that it is still there.
+        // This takes a few ms instead of a new activation (+ authentication for random ID cards).
+        if (gb_CardPresent)
+        {
+            if (gi_PN532.IsCardPresent())
+            {
+                u64_LastRead = Utils::GetMillis64();
+                return; // the RF field stays on and the card keeps its session
+            }
+            // The card has gone (or did not answer once) -> power down. gu64_LastID is cleared by the next search
+            // if no card is found, so a card that is still there does not open the door a second time.
+            gb_CardPresent = false;
+            break;
+        }
+
+        // Search for a card in the background.
+        // loop() returns immediately and keeps serving the keyboard and the open button until the PN532 has finished.
+        if (!gb_Detecting)
+        {
+            gb_Detecting = gi_PN532.StartReadPassiveTargetID();
+            if (gb_Detecting)
+                return;
+        }
+        else if (gi_PN532.PollCommand() == JOB_Busy)
+        {
+            return;
+        }
+        gb_Detecting = false;
+
         kUser k_User;
         kCard k_Card;
-        if (!ReadCard(k_User.ID.u8, &k_Card))
+        if (!FinishReadCard(k_User.ID.u8, &k_Card))
         {
             if (IsDesfireTimeout())
             {
@@ -315,6 +356,12 @@ void loop()
             break;
         }
 
+        #if USE_DESFIRE
+            // As long as a Desfire card stays on the reader the RF field stays on and the next cycles only check its presence.
+            // Mifare Classic cards do not support the presence check: they are read anew in each cycle.
+            gb_CardPresent = (k_Card.e_CardType != CARD_Unknown);
+        #endif
+
         // Still the same card present
         if (gu64_LastID == k_User.ID.u64) 
             break;
@@ -326,10 +373,13 @@ void loop()
     }
     while (false);
 
-    // Turn off the RF field to save battery
+    // Put the PN532 into power down mode to save battery (this also turns off the RF field)
     // When the RF field is on,  the PN532 board consumes approx 110 mA.
     // When the RF field is off, the PN532 board consumes approx 18 mA.
-    gi_PN532.SwitchOffRfField();
+    // In power down the PN532 chip consumes only some microamperes. The next command wakes it up automatically.
+    // Only while a Desfire card stays on the reader the RF field stays on for the presence check.
+    if (!gb_CardPresent)
+        gi_PN532.EnterPowerDown();
 
     u64_LastRead = Utils::GetMillis64();
 }
@@ -347,9 +397,20 @@ void InitReader(bool b_ShowError)
     do // pseudo loop (just used for aborting with break;)
     {
         gb_InitSuccess = false;
+        gb_CardPresent = false;
       
         // Reset the PN532
         gi_PN532.begin(); // delay > 400 ms
+
+        // Find the fastest timing that works reliably with the cable to the PN532.
+        // This is done only once. The timing is kept when the PN532 is reset after a communication error.
+        static bool b_Calibrated = false;
+        if (!b_Calibrated)
+        {
+            if (!gi_PN532.CalibrateTiming())
+                break;
+            b_Calibrated = true;
+        }
     
         byte IC, VersionHi, VersionLo, Flags;
         if (!gi_PN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags))
@@ -481,6 +542,7 @@ void OnCommandReceived(bool b_PasswordValid)
 
     gs8_CommandBuffer[gu32_CommandPos++] = 0;
     gu32_CommandPos = 0;    
+    StopCardDetection();
     Utils::Print(LF);
 
     if (!b_PasswordValid)
@@ -570,8 +632,8 @@ void OnCommandReceived(bool b_PasswordValid)
                 if (Utils::stricmp(gs8_CommandBuffer, "TEST") == 0)
                 {
                     gi_PN532.SetDebugLevel(COMPILE_SELFTEST);
-                    if (gi_PN532.Selftest()) Utils::Print("\r\nSelftest success\r\n");
-                    else                     Utils::Print("\r\nSelftest failed\r\n");
+                    if (PN532::SelftestFrames() && gi_PN532.Selftest()) Utils::Print("\r\nSelftest success\r\n");
+                    else                                                Utils::Print("\r\nSelftest failed\r\n");
                     gi_PN532.SetDebugLevel(0);
                     gi_PN532.SwitchOffRfField();
                     return;
@@ -847,7 +909,7 @@ bool WaitForCard(kUser* pk_User, kCard* pk_Card)
             // Avoid that later the door is opened for this card if the card is a long time in the RF field.
             gu64_LastID = pk_User->ID.u64;
 
-            // All the stuff in this function takes about 2 seconds because the SPI bus speed has been throttled to 10 kHz.
+            // All the stuff in this function may take a second because the SPI bus speed has been throttled to 100 kHz.
             Utils::Print("Processing... (please do not remove the card)\r\n");
             return true;
         }
@@ -872,15 +934,39 @@ bool WaitForCard(kUser* pk_User, kCard* pk_Card)
 // pk_Card->u8_KeyVersion is > 0 if a random ID card did a valid authentication with SECRET_PICC_MASTER_KEY
 // pk_Card->b_PN532_Error is set true if the error comes from the PN532.
 bool ReadCard(byte u8_UID[8], kCard* pk_Card)
+{
+    if (!gi_PN532.StartReadPassiveTargetID())
+    {
+        memset(pk_Card, 0, sizeof(kCard));
+        pk_Card->b_PN532_Error = true;
+        return false;
+    }
+
+    gi_PN532.WaitCommand();
+    return FinishReadCard(u8_UID, pk_Card);
+}
+
+// Evaluates the result of StartReadPassiveTargetID() after the PN532 has finished.
+// Same return values as ReadCard()
+bool FinishReadCard(byte u8_UID[8], kCard* pk_Card)
 {
     memset(pk_Card, 0, sizeof(kCard));
   
-    if (!gi_PN532.ReadPassiveTargetID(u8_UID, &pk_Card->u8_UidLength, &pk_Card->e_CardType))
+    if (!gi_PN532.FinishReadPassiveTargetID(u8_UID, &pk_Card->u8_UidLength, &pk_Card->e_CardType))
     {
         pk_Card->b_PN532_Error = true;
         return false;
     }
 
+    #if USE_DESFIRE
+        // Desfire cards support up to 848 kB. This must be the first command after the card has been detected.
+        if (pk_Card->e_CardType != CARD_Unknown && !gi_PN532.UpgradeBitrate())
+        {
+            pk_Card->b_PN532_Error = true;
+            return false;
+        }
+    #endif
+
     if (pk_Card->e_CardType == CARD_DesRandom) // The card is a Desfire card in random ID mode
     {
         #if USE_DESFIRE
@@ -900,6 +986,28 @@ bool ReadCard(byte u8_UID[8], kCard* pk_Card)
     return true;
 }
 
+// Aborts a card detection that is running in the background and turns off the RF field.
+// Must be called before any other command is sent to the PN532.
+void StopCardDetection()
+{
+    // The RF field has been left on for the presence check of the last card
+    if (gb_CardPresent)
+    {
+        gi_PN532.SwitchOffRfField();
+        gb_CardPresent = false;
+    }
+
+    if (!gb_Detecting)
+        return;
+
+    byte  u8_UID[8];
+    kCard k_Card;
+    gi_PN532.WaitCommand();
+    gi_PN532.FinishReadPassiveTargetID(u8_UID, &k_Card.u8_UidLength, &k_Card.e_CardType);
+    gi_PN532.SwitchOffRfField();
+    gb_Detecting = false;
+}
+
 // returns true if the cause of the last error was a Timeout.
 // This may happen for Desfire cards when the card is too far away from the reader.
 bool IsDesfireTimeout()
@@ -974,7 +1082,8 @@ void OpenDoor(uint64_t u64_ID, kCard* pk_Card, uint64_t u64_StartTick)
         // In Classic         mode: 125 ms
         // In Desfire Random  mode: 676 ms
         // In Desfire Default mode: 799 ms
-        // If you want to get this faster modify PN532_SOFT_SPI_DELAY but you must check the SPI signals on an oscilloscope!
+        // (measured with the former soft SPI clock of 10 kHz)
+        // CalibrateTiming() in InitReader() already selects the fastest soft SPI clock that works with your cable.
         char s8_Buf[80];
         sprintf(s8_Buf, "Reading the card took %d ms.\r\n", (int)(Utils::GetMillis64() - u64_StartTick));
         Utils::Print(s8_Buf);
@@ -1148,6 +1257,10 @@ bool CheckDesfireSecret(kUser* pk_User)
     if (!gi_PN532.Authenticate(0, &i_AppMasterKey))
         return false;
 
+    // StoreDesfireSecret() has created the file with CM_PLAIN -> no need to read the file settings on every tap
+    if (!gi_PN532.SetFileMode(CARD_FILE_ID, CM_PLAIN, CM_PLAIN))
+        return false;
+
     // Read the 16 byte secret from the card
     byte u8_FileData[16];
     if (!gi_PN532.ReadFileData(CARD_FILE_ID, 0, 16, u8_FileData))
@@ -1231,7 +1344,8 @@ bool StoreDesfireSecret(kUser* pk_User)
     k_Permis.e_WriteAccess        = AR_KEY0;
     k_Permis.e_ReadAndWriteAccess = AR_KEY0;
     k_Permis.e_ChangeAccess       = AR_KEY0;
-    if (!gi_PN532.CreateStdDataFile(CARD_FILE_ID, &k_Permis, 16))
+    if (!gi_PN532.CreateStdDataFile(CARD_FILE_ID, &k_Permis, 16, CM_PLAIN) ||
+        !gi_PN532.SetFileMode      (CARD_FILE_ID, CM_PLAIN, CM_PLAIN))
         return false;
 
     // Write the StoreValue into that file